@@ -19,6 +19,9 @@
 
 #include <SFML/Graphics.hpp>
 
+#include "mapped_file.h"
+#include "dirty_rows.h"
+
 using addr_t = uint16_t;
 using regix_t = uint8_t;
 using data_t = uint8_t;
@@ -159,9 +162,10 @@ public:
                 0xF0, 0x80, 0xF0, 0x80, 0x80  // F
         };
         std::copy(fonts.begin(), fonts.end(), mem.begin() + FONT_ADDRESSES);
-        std::ifstream input(romName, std::ios::binary);
-        std::vector<unsigned char> buffer(std::istreambuf_iterator<char>(input), {});
-        std::copy(buffer.begin(), buffer.end(), mem.begin() + USER_SPACE_START);
+        // programs can write over themselves so they get a private copy of the shared mapping
+        auto rom = MappedFile::openShared(romName);
+        std::copy_n(rom->data, std::min<size_t>(rom->size, MAIN_MEMORY_SIZE_B - USER_SPACE_START),
+                    mem.begin() + USER_SPACE_START);
 
         // Jump instruction
         mem[0] = 0x1;
@@ -204,9 +208,11 @@ class display_t {
 public:
 
     std::vector<std::bitset<64>> disp;
+    DirtyRows dirtyRows; // device rows written since the frontend last uploaded them
 
     display_t(int _displayHeight, int _displayWidth, sf::Uint32 *_deviceBuffer) :
             disp(SCREEN_HEIGHT, std::bitset<SCREEN_WIDTH>{0x0}),
+            dirtyRows{_displayHeight},
             displayHeight{_displayHeight},
             displayWidth{_displayWidth},
             pixelDisplaySizeHeight{
@@ -223,6 +229,7 @@ public:
 
     void clear() {
         std::fill(deviceBuffer, deviceBuffer + displayWidth * displayHeight, 0x0);
+        dirtyRows.markAll();
     }
 
     unsigned char f(unsigned char b) const {
@@ -285,6 +292,9 @@ public:
 
             vf |= (disp[screenY] & mask).any();
             disp[screenY] ^= mask;
+            if (mask.any()) {
+                dirtyRows.mark(screenY * pixelDisplaySizeHeight, (screenY + 1) * pixelDisplaySizeHeight);
+            }
 
             for (int j = 0; j < 8; ++j) {
                 int screenX = x + j;
@@ -690,6 +700,10 @@ public:
     }
 
 
+    DirtyRows &dirtyRows() {
+        return disp.dirtyRows;
+    }
+
     void updateTimers() {
         delayTimer.decrement();
         soundTimer.decrement();
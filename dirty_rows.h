@@ -0,0 +1,72 @@
+//
+// Created by jc on 17/10/26.
+//
+
+#ifndef GBA_EMULATOR_DIRTY_ROWS_H
+#define GBA_EMULATOR_DIRTY_ROWS_H
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+// One bit per framebuffer row, set by the renderer when it changes a row and cleared as the frontend uploads it.
+// Presenting walks the runs of set bits, so a frame where nothing changed uploads and shows nothing.
+class DirtyRows {
+public:
+    explicit DirtyRows(int rows) : rows{rows}, words((rows + 63) / 64, 0) {
+        markAll();
+    }
+
+    void mark(int row) {
+        words[row >> 6] |= uint64_t{1} << (row & 63);
+    }
+
+    void mark(int from, int to) {
+        for (int row = from; row < to; ++row) {
+            mark(row);
+        }
+    }
+
+    // the window needs everything again, e.g. after a resize
+    void markAll() {
+        mark(0, rows);
+    }
+
+    [[nodiscard]] bool any() const {
+        for (uint64_t word: words) {
+            if (word) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // calls upload(from, to) for each run of dirty rows [from, to) and leaves them all clean
+    template<typename F>
+    void flush(F &&upload) {
+        int from = -1;
+        for (int row = 0; row < rows; ++row) {
+            if (!(row & 63) && !words[row >> 6] && from < 0) {
+                row += 63; // nothing dirty in this word
+                continue;
+            }
+            bool dirty = words[row >> 6] >> (row & 63) & 1;
+            if (dirty && from < 0) {
+                from = row;
+            } else if (!dirty && from >= 0) {
+                upload(from, row);
+                from = -1;
+            }
+        }
+        if (from >= 0) {
+            upload(from, rows);
+        }
+        std::fill(words.begin(), words.end(), 0);
+    }
+
+private:
+    int rows;
+    std::vector<uint64_t> words;
+};
+
+#endif //GBA_EMULATOR_DIRTY_ROWS_H
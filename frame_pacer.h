@@ -0,0 +1,122 @@
+//
+// Created by jc on 17/10/26.
+//
+
+#ifndef GBA_EMULATOR_FRAME_PACER_H
+#define GBA_EMULATOR_FRAME_PACER_H
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+// Keeps frames on a fixed grid of absolute deadlines so sleep overshoot doesn't add up: frame n is due at
+// start + n * period, however late frame n - 1 woke. Unthrottled never sleeps, speed N runs N times real time.
+// It also decides which frames get drawn: frameskip N draws one frame in N + 1, auto draws unless the host
+// has already missed the frame's deadline.
+class FramePacer {
+public:
+    // past this many frames behind the grid restarts from now instead of running flat out to catch up
+    constexpr static uint64_t MAX_FRAMES_BEHIND = 4;
+    constexpr static int AUTO_FRAMESKIP = -1;
+    // auto still draws at least one frame in this many so the screen doesn't freeze on a slow host
+    constexpr static int MAX_AUTO_SKIPPED = 4;
+
+    double framesPerSecond;
+    double speed;
+    bool unthrottled;
+    int frameskip;
+
+    explicit FramePacer(double framesPerSecond) : framesPerSecond{framesPerSecond}, speed{1.0},
+                                                  unthrottled{false}, frameskip{0}, start{now()}, frames{0},
+                                                  skipped{0} {
+    }
+
+    // takes --unthrottled, --speed N and --frameskip N|auto off the command line, anything else is left alone
+    void parseArgs(int argc, char **argv) {
+        for (int i = 1; i < argc; ++i) {
+            if (strcmp(argv[i], "--unthrottled") == 0) {
+                unthrottled = true;
+            } else if (strcmp(argv[i], "--speed") == 0 && i + 1 < argc) {
+                setSpeed(atof(argv[++i]));
+            } else if (strcmp(argv[i], "--frameskip") == 0 && i + 1 < argc) {
+                ++i;
+                frameskip = strcmp(argv[i], "auto") == 0 ? AUTO_FRAMESKIP : atoi(argv[i]);
+            }
+        }
+    }
+
+    void setSpeed(double newSpeed) {
+        if (newSpeed <= 0) {
+            throw "Speed must be positive";
+        }
+        speed = newSpeed;
+        restart();
+    }
+
+    void setUnthrottled(bool on) {
+        unthrottled = on;
+        restart();
+    }
+
+    // whether the frame about to be emulated should be drawn and shown, call once per frame before it runs
+    bool shouldDraw() {
+        bool draw;
+        if (frameskip == AUTO_FRAMESKIP) {
+            draw = unthrottled || skipped >= MAX_AUTO_SKIPPED || now() <= deadline(frames + 1);
+        } else {
+            draw = skipped >= frameskip;
+        }
+        skipped = draw ? 0 : skipped + 1;
+        return draw;
+    }
+
+    // sleeps until the deadline of the next frame
+    void waitForNextFrame() {
+        ++frames;
+        if (unthrottled) {
+            return;
+        }
+        int64_t due = deadline(frames);
+        int64_t current = now();
+        if (current - due > static_cast<int64_t>(MAX_FRAMES_BEHIND) * framePeriod()) {
+            // a stall (breakpoint, window drag) shouldn't be followed by a burst of frames
+            restart();
+            return;
+        }
+        timespec ts{static_cast<time_t>(due / NANOS_PER_SECOND), static_cast<long>(due % NANOS_PER_SECOND)};
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR) {
+        }
+    }
+
+private:
+    constexpr static int64_t NANOS_PER_SECOND = 1000000000;
+
+    int64_t start; // CLOCK_MONOTONIC nanoseconds frame 0 was due at
+    uint64_t frames;
+    int skipped; // frames in a row not drawn
+
+    static int64_t now() {
+        timespec ts{};
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * NANOS_PER_SECOND + ts.tv_nsec;
+    }
+
+    [[nodiscard]] int64_t framePeriod() const {
+        return static_cast<int64_t>(NANOS_PER_SECOND / (framesPerSecond * speed));
+    }
+
+    // worked out from the frame count each time so the rounding of the period doesn't drift
+    [[nodiscard]] int64_t deadline(uint64_t frame) const {
+        return start + static_cast<int64_t>(static_cast<long double>(frame) * NANOS_PER_SECOND /
+                                            (framesPerSecond * speed));
+    }
+
+    void restart() {
+        start = now();
+        frames = 0;
+    }
+};
+
+#endif //GBA_EMULATOR_FRAME_PACER_H
@@ -293,13 +293,11 @@ public:
     SoundOutputSelection &soundOutputSelection;
     SoundOnOff &soundOnOff;
 
-    PulseA cpPA;
-    PulseB cpPB;
-    Wave cpW;
-    Noise cpN;
-    ChannelControl cpCCReg;
-    SoundOutputSelection cpSoundOutputSelection;
-    SoundOnOff cpSoundOnOff;
+    // set by writeRegister, a channel only needs regenerating after the game writes to it
+    bool pulseAWritten;
+    bool pulseBWritten;
+    bool waveWritten;
+    bool noiseWritten;
     u8 &channel3SoundOnOff;
 
     RingBuffer ch1;
@@ -319,12 +317,8 @@ public:
               soundOutputSelection{*reinterpret_cast<SoundOutputSelection *>(&vram[0xFF25])},
               soundOnOff{*reinterpret_cast<SoundOnOff *>(&vram[0xFF26])},
               channel3SoundOnOff{vram[0xFF1A]},
-              cpPA{paReg},
-              cpPB{pbReg},
-              cpW{wvReg},
-              cpN{noReg},
-              waveData{reinterpret_cast<WaveData *>(&vram[0xFF30])},
-              cpCCReg{ccReg}, cpSoundOutputSelection{soundOutputSelection}, cpSoundOnOff{soundOnOff}, clock{0} {
+              pulseAWritten{false}, pulseBWritten{false}, waveWritten{false}, noiseWritten{false},
+              waveData{reinterpret_cast<WaveData *>(&vram[0xFF30])}, clock{0} {
 
         std::array<u8, sizeof(PulseA)> pa = {0x80, 0xBF, 0xF3, 0x00, 0xBF};
         paReg = *reinterpret_cast<PulseA *>(&pa[0]);
@@ -362,6 +356,24 @@ public:
 
     }
 
+    void writeRegister(u16 addr, u8 val, uint64_t cpuClock) {
+        vram[addr] = val;
+        if (addr <= 0xFF14) {
+            pulseAWritten = true;
+        } else if (addr >= 0xFF16 && addr <= 0xFF19) {
+            pulseBWritten = true;
+        } else if (addr >= 0xFF1A && addr <= 0xFF1E) {
+            waveWritten = true;
+        } else if (addr >= 0xFF20 && addr <= 0xFF23) {
+            noiseWritten = true;
+        }
+        // a trigger (bit 7 of NRx4) starts the channel now rather than at the next 512Hz tick, and a second
+        // trigger before that tick isn't folded into the first
+        if ((addr == 0xFF14 || addr == 0xFF19 || addr == 0xFF1E || addr == 0xFF23) && (val & 0x80)) {
+            run(cpuClock);
+        }
+    }
+
     void run(uint64_t cpuClock) {
         u8 masterVolume2 = ccReg.so2Output;
         u8 masterVolume1 = ccReg.so1Output;
@@ -376,7 +388,7 @@ public:
             soundOutputSelection.clear();
             soundOnOff.clear();
         } else {
-            if (paReg.counter && cpPA != paReg || paReg.restart) {
+            if (paReg.counter && pulseAWritten || paReg.restart) {
                 ch1.snapToNow();
                 paReg.restart = 0;
                 int initialVol = paReg.initialVol;
@@ -400,7 +412,7 @@ public:
 //                ch1.drain(ch1.size());
 //            }
 
-            if (pbReg.counter && cpPB != pbReg || pbReg.restart > 0) {
+            if (pbReg.counter && pulseBWritten || pbReg.restart > 0) {
                 ch2.snapToNow();
                 pbReg.restart = 0;
 
@@ -417,7 +429,7 @@ public:
 //            else if (pbReg.counter + pbReg.restart == 0) {
 //                ch2.drain(ch2.size());
 //            }
-            if (wvReg.counter && wvReg != cpW || wvReg.restart) {
+            if (wvReg.counter && waveWritten || wvReg.restart) {
                 ch3.snapToNow();
                 wvReg.restart = 0;
                 generateWave(wvReg, 0);
@@ -425,7 +437,7 @@ public:
 //            else if ((channel3SoundOnOff >> 7) == 0) {
 //                ch3.drain(ch3.size());
 //            }
-            if (cpN != noReg) {
+            if (noiseWritten) {
                 ch4.snapToNow();
 
             }
@@ -445,13 +457,10 @@ public:
 
         clock = cpuClock;
 
-        cpPA = paReg;
-        cpPB = pbReg;
-        cpW = wvReg;
-        cpN = noReg;
-        cpCCReg = ccReg;
-        cpSoundOutputSelection = soundOutputSelection;
-        cpSoundOnOff = soundOnOff;
+        pulseAWritten = false;
+        pulseBWritten = false;
+        waveWritten = false;
+        noiseWritten = false;
     }
 
     long long flush() {
@@ -86,9 +86,9 @@ std::map<u8, std::string> ramSizeDescr = {
 };
 
 
-void dumpCartridgeHeader(std::vector<u8> &ram) {
+void dumpCartridgeHeader(const u8 *rom) {
 
-    auto header = *reinterpret_cast<CartridgeHeader *>(&ram[0x100]);
+    auto header = *reinterpret_cast<const CartridgeHeader *>(&rom[0x100]);
     std::cout << "entryPoint: " << header.entryPoint << std::endl;
     std::cout << "nintendoLogo: " << header.nintendoLogo << std::endl;
     std::cout << "title: " << header.title << std::endl;
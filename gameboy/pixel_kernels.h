@@ -0,0 +1,148 @@
+//
+// Created by jc on 17/10/26.
+//
+
+#ifndef GBA_EMULATOR_PIXEL_KERNELS_H
+#define GBA_EMULATOR_PIXEL_KERNELS_H
+
+#include <cstdint>
+#include <cstring>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define PIXEL_KERNELS_X86
+#include <immintrin.h>
+#endif
+
+using u8 = uint8_t;
+
+// The inner loops of the scanline renderer, picked once at startup from what the cpu supports. Each has a
+// scalar version that the others must agree with exactly, under DEBUG that is checked before the first use.
+//
+//  decodeRow:    a tile row's two bitplanes to 8 colour indices, leftmost pixel first
+//  mergeLayers:  takes top where mask is 0xFF and keeps the line where it's 0
+// Palettes need no kernel, the ppu keeps them as RGBA tables.
+struct PixelKernels {
+    using DecodeRow = void (*)(u8 low, u8 high, u8 *indices);
+    using MergeLayers = void (*)(u8 *line, const u8 *top, const u8 *mask, int n);
+
+    DecodeRow decodeRow;
+    MergeLayers mergeLayers;
+    const char *name;
+
+    static const PixelKernels &get() {
+        static const PixelKernels kernels = select();
+        return kernels;
+    }
+
+    static void decodeRowScalar(u8 low, u8 high, u8 *indices) {
+        for (int i = 0; i < 8; ++i) {
+            indices[i] = ((low >> (7 - i)) & 1) | (((high >> (7 - i)) & 1) << 1);
+        }
+    }
+
+    static void mergeLayersScalar(u8 *line, const u8 *top, const u8 *mask, int n) {
+        for (int i = 0; i < n; ++i) {
+            line[i] = (top[i] & mask[i]) | (line[i] & ~mask[i]);
+        }
+    }
+
+#ifdef PIXEL_KERNELS_X86
+    // pdep spreads bit i of each plane to byte i, the byte swap puts bit 7 (the leftmost pixel) first
+    __attribute__((target("bmi2")))
+    static void decodeRowBMI2(u8 low, u8 high, u8 *indices) {
+        uint64_t spread = _pdep_u64(low, 0x0101010101010101ULL) | _pdep_u64(high, 0x0202020202020202ULL);
+        spread = __builtin_bswap64(spread);
+        memcpy(indices, &spread, 8);
+    }
+
+    static void decodeRowSSE2(u8 low, u8 high, u8 *indices) {
+        const __m128i bits = _mm_setr_epi8(-128, 64, 32, 16, 8, 4, 2, 1, 0, 0, 0, 0, 0, 0, 0, 0);
+        __m128i lowSet = _mm_cmpeq_epi8(_mm_and_si128(_mm_set1_epi8(static_cast<char>(low)), bits), bits);
+        __m128i highSet = _mm_cmpeq_epi8(_mm_and_si128(_mm_set1_epi8(static_cast<char>(high)), bits), bits);
+        __m128i result = _mm_or_si128(_mm_and_si128(lowSet, _mm_set1_epi8(1)),
+                                      _mm_and_si128(highSet, _mm_set1_epi8(2)));
+        _mm_storel_epi64(reinterpret_cast<__m128i *>(indices), result);
+    }
+
+    static void mergeLayersSSE2(u8 *line, const u8 *top, const u8 *mask, int n) {
+        int i = 0;
+        for (; i + 16 <= n; i += 16) {
+            __m128i l = _mm_loadu_si128(reinterpret_cast<const __m128i *>(line + i));
+            __m128i t = _mm_loadu_si128(reinterpret_cast<const __m128i *>(top + i));
+            __m128i m = _mm_loadu_si128(reinterpret_cast<const __m128i *>(mask + i));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(line + i),
+                             _mm_or_si128(_mm_and_si128(m, t), _mm_andnot_si128(m, l)));
+        }
+        mergeLayersScalar(line + i, top + i, mask + i, n - i);
+    }
+
+    __attribute__((target("avx2")))
+    static void mergeLayersAVX2(u8 *line, const u8 *top, const u8 *mask, int n) {
+        int i = 0;
+        for (; i + 32 <= n; i += 32) {
+            __m256i l = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(line + i));
+            __m256i t = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(top + i));
+            __m256i m = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(mask + i));
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(line + i), _mm256_blendv_epi8(l, t, m));
+        }
+        mergeLayersSSE2(line + i, top + i, mask + i, n - i);
+    }
+#endif
+
+    static PixelKernels scalar() {
+        return {decodeRowScalar, mergeLayersScalar, "scalar"};
+    }
+
+    static PixelKernels select() {
+        PixelKernels kernels = scalar();
+#ifdef PIXEL_KERNELS_X86
+        __builtin_cpu_init();
+        kernels = {decodeRowSSE2, mergeLayersSSE2, "sse2"};
+        if (__builtin_cpu_supports("avx2")) {
+            kernels.mergeLayers = mergeLayersAVX2;
+            kernels.name = "avx2";
+        }
+        // decoding only runs when the tile cache misses, so pdep being slow on older AMD parts doesn't matter
+        if (__builtin_cpu_supports("bmi2")) {
+            kernels.decodeRow = decodeRowBMI2;
+        }
+#endif
+#ifdef DEBUG
+        kernels.checkAgainst(scalar());
+#endif
+        return kernels;
+    }
+
+    // runs both sets over the same vectors, every bitplane pair and a line length that leaves
+    // a tail for the scalar remainder
+    void checkAgainst(const PixelKernels &reference) const {
+        constexpr int N = 160 + 13;
+        for (int low = 0; low < 256; ++low) {
+            for (int high = 0; high < 256; ++high) {
+                u8 got[8], expected[8];
+                decodeRow(low, high, got);
+                reference.decodeRow(low, high, expected);
+                if (memcmp(got, expected, 8) != 0) {
+                    throw "decodeRow disagrees with the scalar kernel";
+                }
+            }
+        }
+
+        u8 indices[N], top[N], mask[N];
+        for (int i = 0; i < N; ++i) {
+            indices[i] = (i * 7 + i / 5) & 3;
+            top[i] = 4 + ((i * 3) & 7);
+            mask[i] = (i % 3 == 0 || i % 7 == 0) ? 0xFF : 0;
+        }
+        u8 got[N], expected[N];
+        memcpy(got, indices, N);
+        memcpy(expected, indices, N);
+        mergeLayers(got, top, mask, N);
+        reference.mergeLayers(expected, top, mask, N);
+        if (memcmp(got, expected, N) != 0) {
+            throw "mergeLayers disagrees with the scalar kernel";
+        }
+    }
+};
+
+#endif //GBA_EMULATOR_PIXEL_KERNELS_H
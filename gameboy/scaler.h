@@ -0,0 +1,250 @@
+//
+// Created by jc on 17/10/26.
+//
+
+#ifndef GBA_EMULATOR_SCALER_H
+#define GBA_EMULATOR_SCALER_H
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Blows the native RGBA frame up to the window once per presented frame. SPRITE leaves the frame alone and
+// has the GPU stretch it, the others scale on the cpu into their own buffer:
+//  NEAREST:    every pixel becomes a scale x scale block
+//  SCALE2X/3X: the EPX family, edges are smoothed where neighbours agree (scale is 2 or 3)
+//  SCANLINES:  nearest with the last row of every block darkened
+class Scaler {
+public:
+    enum Filter {
+        SPRITE,
+        NEAREST,
+        SCALE2X,
+        SCALE3X,
+        SCANLINES
+    };
+
+    Filter filter;
+    int scale;
+    int width;
+    int height;
+
+    Scaler(int width, int height, Filter filter, int scale) : filter{filter}, scale{scale}, width{width},
+                                                              height{height} {
+        if (filter == SCALE2X) {
+            this->scale = 2;
+        } else if (filter == SCALE3X) {
+            this->scale = 3;
+        }
+        if (this->scale < 1) {
+            throw "Scale must be at least 1";
+        }
+        if (filter != SPRITE) {
+            scaled.resize(size_t(outputWidth()) * outputHeight());
+        }
+    }
+
+    static Filter parseFilter(const char *name) {
+        if (strcmp(name, "nearest") == 0) {
+            return NEAREST;
+        } else if (strcmp(name, "scale2x") == 0) {
+            return SCALE2X;
+        } else if (strcmp(name, "scale3x") == 0) {
+            return SCALE3X;
+        } else if (strcmp(name, "scanlines") == 0) {
+            return SCANLINES;
+        }
+        return SPRITE;
+    }
+
+    [[nodiscard]] int outputWidth() const {
+        return width * scale;
+    }
+
+    [[nodiscard]] int outputHeight() const {
+        return height * scale;
+    }
+
+    // the texture has the frame's size with SPRITE, the window's otherwise
+    [[nodiscard]] int textureWidth() const {
+        return filter == SPRITE ? width : outputWidth();
+    }
+
+    [[nodiscard]] int textureHeight() const {
+        return filter == SPRITE ? height : outputHeight();
+    }
+
+    // what the sprite showing the texture is stretched by
+    [[nodiscard]] float spriteScale() const {
+        return filter == SPRITE ? float(scale) : 1.0f;
+    }
+
+    // the rows of the texture to update: height rows starting at y, pixels points at row y
+    struct Region {
+        const uint8_t *pixels;
+        int y;
+        int height;
+    };
+
+    // scales rows [from, to) of the frame, the region returned covers every output row they affect: with SPRITE
+    // that's the frame's own rows, the EPX filters also redo the rows either side as those look at their
+    // neighbours
+    Region present(const uint8_t *frame, int from = 0, int to = -1) {
+        if (to < 0) {
+            to = height;
+        }
+        const auto *in = reinterpret_cast<const uint32_t *>(frame);
+        switch (filter) {
+            case SPRITE:
+                return {frame + 4 * from * width, from, to - from};
+            case NEAREST:
+            case SCANLINES:
+                for (int y = from; y < to; ++y) {
+                    nearestRow(in + y * width, y);
+                }
+                break;
+            case SCALE2X:
+            case SCALE3X:
+                from = from > 0 ? from - 1 : 0;
+                to = to < height ? to + 1 : height;
+                for (int y = from; y < to; ++y) {
+                    if (filter == SCALE2X) {
+                        scale2xRow(in, y);
+                    } else {
+                        scale3xRow(in, y);
+                    }
+                }
+                break;
+        }
+        return {reinterpret_cast<const uint8_t *>(outputRow(from * scale)), from * scale, (to - from) * scale};
+    }
+
+private:
+    std::vector<uint32_t> scaled;
+
+    uint32_t *outputRow(int y) {
+        return &scaled[size_t(y) * outputWidth()];
+    }
+
+    // one row is widened, the others in the block are copies of it
+    void nearestRow(const uint32_t *in, int y) {
+        uint32_t *out = outputRow(y * scale);
+        widen(in, out);
+        for (int dy = 1; dy < scale; ++dy) {
+            memcpy(outputRow(y * scale + dy), out, outputWidth() * sizeof(uint32_t));
+        }
+        if (filter == SCANLINES && scale > 1) {
+            darken(outputRow(y * scale + scale - 1), outputWidth());
+        }
+    }
+
+    void widen(const uint32_t *in, uint32_t *out) const {
+        int x = 0;
+#ifdef __SSE2__
+        // 4 pixels at a time: an unpack with itself doubles them, three shuffles triple them
+        if (scale == 2) {
+            for (; x + 4 <= width; x += 4) {
+                __m128i p = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + x));
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(out + 2 * x), _mm_unpacklo_epi32(p, p));
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(out + 2 * x + 4), _mm_unpackhi_epi32(p, p));
+            }
+        } else if (scale == 3) {
+            for (; x + 4 <= width; x += 4) {
+                __m128i p = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + x));
+                __m128i *o = reinterpret_cast<__m128i *>(out + 3 * x);
+                _mm_storeu_si128(o, _mm_shuffle_epi32(p, _MM_SHUFFLE(1, 0, 0, 0)));
+                _mm_storeu_si128(o + 1, _mm_shuffle_epi32(p, _MM_SHUFFLE(2, 2, 1, 1)));
+                _mm_storeu_si128(o + 2, _mm_shuffle_epi32(p, _MM_SHUFFLE(3, 3, 3, 2)));
+            }
+        } else if (scale == 4) {
+            for (; x < width; ++x) {
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(out + 4 * x), _mm_set1_epi32(int(in[x])));
+            }
+        }
+#endif
+        for (; x < width; ++x) {
+            for (int dx = 0; dx < scale; ++dx) {
+                out[x * scale + dx] = in[x];
+            }
+        }
+    }
+
+    // halves the colour channels and keeps alpha
+    static void darken(uint32_t *row, int n) {
+        int x = 0;
+#ifdef __SSE2__
+        const __m128i alpha = _mm_set1_epi32(int(alphaMask()));
+        const __m128i half = _mm_set1_epi8(0x7F);
+        for (; x + 4 <= n; x += 4) {
+            __m128i p = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row + x));
+            __m128i dark = _mm_and_si128(_mm_srli_epi16(p, 1), half);
+            dark = _mm_or_si128(_mm_andnot_si128(alpha, dark), _mm_and_si128(alpha, p));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(row + x), dark);
+        }
+#endif
+        for (; x < n; ++x) {
+            uint32_t alpha = row[x] & alphaMask();
+            row[x] = (((row[x] >> 1) & 0x7F7F7F7F) & ~alphaMask()) | alpha;
+        }
+    }
+
+    // the 4th byte in memory, whatever the endianness
+    static uint32_t alphaMask() {
+        const uint8_t bytes[4] = {0, 0, 0, 0xFF};
+        uint32_t mask;
+        memcpy(&mask, bytes, 4);
+        return mask;
+    }
+
+    [[nodiscard]] uint32_t at(const uint32_t *in, int x, int y) const {
+        x = x < 0 ? 0 : x >= width ? width - 1 : x;
+        y = y < 0 ? 0 : y >= height ? height - 1 : y;
+        return in[y * width + x];
+    }
+
+    void scale2xRow(const uint32_t *in, int y) {
+        uint32_t *top = outputRow(2 * y);
+        uint32_t *bottom = outputRow(2 * y + 1);
+        for (int x = 0; x < width; ++x) {
+            uint32_t b = at(in, x, y - 1), d = at(in, x - 1, y), e = at(in, x, y), f = at(in, x + 1, y);
+            uint32_t h = at(in, x, y + 1);
+            if (b != h && d != f) {
+                top[2 * x] = d == b ? d : e;
+                top[2 * x + 1] = b == f ? f : e;
+                bottom[2 * x] = d == h ? d : e;
+                bottom[2 * x + 1] = h == f ? f : e;
+            } else {
+                top[2 * x] = top[2 * x + 1] = bottom[2 * x] = bottom[2 * x + 1] = e;
+            }
+        }
+    }
+
+    void scale3xRow(const uint32_t *in, int y) {
+        uint32_t *rows[3] = {outputRow(3 * y), outputRow(3 * y + 1), outputRow(3 * y + 2)};
+        for (int x = 0; x < width; ++x) {
+            uint32_t a = at(in, x - 1, y - 1), b = at(in, x, y - 1), c = at(in, x + 1, y - 1);
+            uint32_t d = at(in, x - 1, y), e = at(in, x, y), f = at(in, x + 1, y);
+            uint32_t g = at(in, x - 1, y + 1), h = at(in, x, y + 1), i = at(in, x + 1, y + 1);
+            uint32_t out[9] = {e, e, e, e, e, e, e, e, e};
+            if (b != h && d != f) {
+                out[0] = d == b ? d : e;
+                out[1] = (d == b && e != c) || (b == f && e != a) ? b : e;
+                out[2] = b == f ? f : e;
+                out[3] = (d == b && e != g) || (d == h && e != a) ? d : e;
+                out[5] = (b == f && e != i) || (h == f && e != c) ? f : e;
+                out[6] = d == h ? d : e;
+                out[7] = (d == h && e != i) || (h == f && e != g) ? h : e;
+                out[8] = h == f ? f : e;
+            }
+            for (int r = 0; r < 3; ++r) {
+                memcpy(rows[r] + 3 * x, out + 3 * r, 3 * sizeof(uint32_t));
+            }
+        }
+    }
+};
+
+#endif //GBA_EMULATOR_SCALER_H
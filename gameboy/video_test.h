@@ -6,6 +6,9 @@
 
 //#define DEBUG
 #define VERBOSE
+#define LAZY_FLAGS
+//#define PIXEL_FIFO
+#define LAYER_CACHE
 
 #include <algorithm>
 
@@ -22,31 +25,67 @@
 #include <SFML/Audio.hpp>
 #include <queue>
 #include <array>
+#include <cstring>
 #include <cassert>
 #include <fstream>
 #include <unistd.h>
+#include <utility>
+#include <unordered_map>
+#include <functional>
+#include <ctime>
 #include "audio_driver.h"
 #include "debug_utils.h"
+#include "opcodes.h"
+#include "pixel_kernels.h"
+#include "scaler.h"
+#include "../mapped_file.h"
+#include "../frame_pacer.h"
+#include "../dirty_rows.h"
 
 
 using namespace std;
 
-struct InterruptFlag {
-    bool vBlank: 1;
-    bool lcdStat: 1;
-    bool timer: 1;
-    bool serial: 1;
-    bool joypad: 1;
-    u8 _unused: 3;
-};
+// IF (0xFF0F), IE (0xFFFF) and IME. Everything that changes one of them goes through here so the cpu only has
+// to look at `pending` before each instruction.
+class InterruptController {
+public:
+    constexpr static u8 VBLANK = 0x01;
+    constexpr static u8 LCD_STAT = 0x02;
+    constexpr static u8 TIMER = 0x04;
+    constexpr static u8 SERIAL = 0x08;
+    constexpr static u8 JOYPAD = 0x10;
+
+    u8 &ifReg;
+    u8 &ieReg;
+    bool ime;
+
+    u8 pending;     // IF & IE
+    u8 serviceable; // pending, if IME is set
+
+    InterruptController(vector<u8> &ram) : ifReg{ram[0xFF0F]}, ieReg{ram[0xFFFF]}, ime{false}, pending{0},
+                                           serviceable{0} {
+    }
+
+    void request(u8 interrupt) {
+        ifReg |= interrupt;
+        update();
+    }
 
-struct InterruptEnable {
-    bool vBlank: 1;
-    bool lcdStat: 1;
-    bool timer: 1;
-    bool serial: 1;
-    bool joypad: 1;
-    u8 _unused: 3;
+    void acknowledge(u8 interrupt) {
+        ifReg &= ~interrupt;
+        update();
+    }
+
+    void setIme(bool enabled) {
+        ime = enabled;
+        update();
+    }
+
+    // call after IF or IE were written directly
+    void update() {
+        pending = ifReg & ieReg & 0x1F;
+        serviceable = ime ? pending : 0;
+    }
 };
 
 
@@ -80,10 +119,547 @@ struct FlagReg {
     bool zf: 1;
 };
 
+// operation the flags were last produced by, see CPU::recordFlags
+enum FlagOp : u8 {
+    FLAGS_CLEAN, // f is up to date
+    FLAGS_ADD,
+    FLAGS_SUB,
+    FLAGS_AND,
+    FLAGS_OR,
+    FLAGS_INC,
+    FLAGS_DEC
+};
+
 
 constexpr int KEYPRESS = sf::Event::EventType::KeyPressed;
 constexpr int KEYRELEASED = sf::Event::EventType::KeyReleased;
 
+// 256-entry page table in front of the 64KB address space. Plain memory is mapped as a pointer per page so
+// reads and writes stay a single indexed access, pages without a pointer go through their handler instead.
+// Writes to the io page are dispatched per register so side effects happen at the time of the write.
+class Bus {
+public:
+    using ReadHandler = function<u8(u16)>;
+    using WriteHandler = function<void(u16, u8)>;
+
+    vector<u8> &ram;
+
+    array<const u8 *, 256> readPages;
+    array<u8 *, 256> writePages;
+    array<ReadHandler, 256> readHandlers;
+    array<WriteHandler, 256> writeHandlers;
+    array<ReadHandler, 256> ioReadHandlers; // 0xFF00 - 0xFFFF
+    array<WriteHandler, 256> ioWriteHandlers;
+
+    // bumped on every write and remap so translated code can tell when it changed
+    array<u32, 256> pageVersion;
+    u16 romBank; // bank mapped at 0x4000-0x7FFF
+
+    // while OAM DMA runs the cpu only reaches 0xFF00-0xFFFF. The other pages lose their pointers so accesses
+    // fall to the slow path, which asks releaseLock whether the transfer is over before giving up.
+    bool locked;
+    array<const u8 *, 256> unlockedReadPages;
+    array<u8 *, 256> unlockedWritePages;
+    function<bool()> releaseLock;
+
+    Bus(vector<u8> &ram) : ram{ram}, pageVersion{}, romBank{1}, locked{false} {
+        for (int page = 0; page < 256; ++page) {
+            mapMemory(page, &ram[page << 8]);
+        }
+        // echo of 0xC000 - 0xDDFF
+        for (int page = 0xE0; page < 0xFE; ++page) {
+            mapMemory(page, &ram[(page - 0x20) << 8]);
+        }
+        // writes to the rom are cartridge control
+        for (int page = 0x00; page < 0x80; ++page) {
+            setWriteHandler(page, [](u16, u8) {});
+        }
+        // nothing is mapped at 0xFEA0 - 0xFEFF
+        setWriteHandler(0xFE, [this](u16 addr, u8 val) {
+            if (addr < 0xFEA0) {
+                this->ram[addr] = val;
+            }
+        });
+        setReadHandler(0xFF, [this](u16 addr) {
+            return readIO(addr);
+        });
+        setWriteHandler(0xFF, [this](u16 addr, u8 val) {
+            writeIO(addr, val);
+        });
+    }
+
+    u8 read8(u16 addr) const {
+        const u8 *page = readPages[addr >> 8];
+        if (page) {
+            return page[addr & 0xFF];
+        }
+        if (isHRAM(addr)) {
+            return ram[addr];
+        }
+        if (locked && addr < 0xFF00) {
+            return releaseLock() ? read8(addr) : 0xFF;
+        }
+        return readHandlers[addr >> 8](addr);
+    }
+
+    // what the address holds regardless of the DMA lock
+    u8 readUnlocked(u16 addr) const {
+        const u8 *page = (locked ? unlockedReadPages : readPages)[addr >> 8];
+        if (page) {
+            return page[addr & 0xFF];
+        }
+        return readHandlers[addr >> 8](addr);
+    }
+
+    void write8(u16 addr, u8 val) {
+        // writes below 0x8000 are cartridge control and leave the rom as it was
+        if (addr & 0x8000) {
+            ++pageVersion[addr >> 8];
+        }
+        u8 *page = writePages[addr >> 8];
+        if (page) {
+            page[addr & 0xFF] = val;
+        } else if (isHRAM(addr)) {
+            ram[addr] = val;
+        } else if (locked && addr < 0xFF00) {
+            if (releaseLock()) {
+                write8(addr, val);
+            }
+        } else {
+            writeHandlers[addr >> 8](addr, val);
+        }
+    }
+
+    void lock() {
+        if (locked) {
+            return;
+        }
+        unlockedReadPages = readPages;
+        unlockedWritePages = writePages;
+        fill(readPages.begin(), readPages.begin() + 0xFF, nullptr);
+        fill(writePages.begin(), writePages.begin() + 0xFF, nullptr);
+        locked = true;
+    }
+
+    void unlock() {
+        if (!locked) {
+            return;
+        }
+        readPages = unlockedReadPages;
+        writePages = unlockedWritePages;
+        locked = false;
+    }
+
+    // the entry mapping functions should change, which is the saved one while locked
+    const u8 *&readPage(u8 page) {
+        return locked && page != 0xFF ? unlockedReadPages[page] : readPages[page];
+    }
+
+    u8 *&writePage(u8 page) {
+        return locked && page != 0xFF ? unlockedWritePages[page] : writePages[page];
+    }
+
+    // 0xFF80 - 0xFFFE is plain memory sharing the io page, read8 and write8 go straight to it and skip the
+    // handlers, so only the registers and IE can have one
+    static bool isHRAM(u16 addr) {
+        return addr >= 0xFF80 && addr != 0xFFFF;
+    }
+
+    u8 readIO(u16 addr) const {
+        auto &handler = ioReadHandlers[addr & 0xFF];
+        return handler ? handler(addr) : ram[addr];
+    }
+
+    void writeIO(u16 addr, u8 val) {
+        auto &handler = ioWriteHandlers[addr & 0xFF];
+        if (handler) {
+            handler(addr, val);
+        } else {
+            ram[addr] = val;
+        }
+    }
+
+    void mapMemory(u8 page, u8 *memory) {
+        readPage(page) = memory;
+        writePage(page) = memory;
+        ++pageVersion[page];
+    }
+
+    void mapReadOnly(u8 page, const u8 *memory) {
+        readPage(page) = memory;
+        ++pageVersion[page];
+    }
+
+    // rom doesn't change under a bank, so this leaves the page versions alone and code translated for the bank
+    // stays valid across switches
+    void mapROMBank(u16 bank, const u8 *memory) {
+        romBank = bank;
+        for (int page = 0x40; page < 0x80; ++page) {
+            readPage(page) = memory + ((page - 0x40) << 8);
+        }
+    }
+
+    void setReadHandler(u8 page, ReadHandler handler) {
+        readPage(page) = nullptr;
+        readHandlers[page] = std::move(handler);
+        ++pageVersion[page];
+    }
+
+    void setWriteHandler(u8 page, WriteHandler handler) {
+        writePage(page) = nullptr;
+        writeHandlers[page] = std::move(handler);
+    }
+
+    void onIORead(u16 addr, ReadHandler handler) {
+        ioReadHandlers[addr & 0xFF] = std::move(handler);
+    }
+
+    void onIOWrite(u16 addr, WriteHandler handler) {
+        ioWriteHandlers[addr & 0xFF] = std::move(handler);
+    }
+};
+
+// Cartridge rom and ram with the bank controllers in front of them. The rom is mapped once, shared with every
+// other cartridge of the same file, and a bank switch only repoints the bus pages at 0x4000-0x7FFF into it.
+// Battery backed ram is a shared mapping of the save file next to the rom.
+class Cartridge {
+public:
+    enum MBCType {
+        ROM_ONLY,
+        MBC1,
+        MBC3,
+        MBC5
+    };
+
+    constexpr static size_t ROM_BANK_SIZE = 0x4000;
+    constexpr static size_t RAM_BANK_SIZE = 0x2000;
+
+    // 0x08 - 0x0C in the ram bank register select these instead of ram
+    enum RTCRegister {
+        RTC_S,
+        RTC_M,
+        RTC_H,
+        RTC_DL,
+        RTC_DH
+    };
+
+    Bus &bus;
+    shared_ptr<const MappedFile> romFile;
+    const u8 *rom;
+    unique_ptr<MappedFile> saveFile;
+    vector<u8> volatileRAM;
+    u8 *sram;
+    size_t sramSize;
+    MBCType type;
+    u16 romBanks;
+
+    bool ramEnabled;
+    u16 romBank;
+    u8 ramBank;
+    u8 bankHi; // MBC1 upper two bank bits
+    bool advancedBanking; // MBC1 mode 1
+
+    array<u8, 5> rtc;
+    array<u8, 5> rtcLatched;
+    time_t rtcUpdated;
+    u8 lastLatchWrite;
+
+    // a battery-backed MBC3 timer keeps its clock after the ram in the .sav, laid out the way other emulators do:
+    // the 5 registers then the 5 latched ones as 32 bit little-endian words, then the unix time they were
+    // current at as 64 bits
+    constexpr static size_t RTC_TRAILER_SIZE = 48;
+    u8 *rtcTrailer; // nullptr when the clock isn't saved
+
+    // battery-backed ram (and clock) is kept in saveFileName, or only in memory when it's empty. two instances
+    // given the same file share one mapping, so each running cartridge needs its own
+    Cartridge(Bus &bus, const string &cartridgeROM, const string &saveFileName) :
+            bus{bus}, ramEnabled{false}, romBank{1}, ramBank{0}, bankHi{0}, advancedBanking{false}, rtc{},
+            rtcLatched{}, rtcUpdated{time(nullptr)}, lastLatchWrite{0xFF}, rtcTrailer{nullptr} {
+        // at least two banks, and whole banks so every mapped page is backed
+        romFile = MappedFile::openShared(cartridgeROM, 2 * ROM_BANK_SIZE);
+        if (romFile->size % ROM_BANK_SIZE) {
+            romFile = MappedFile::openShared(cartridgeROM, (romFile->size / ROM_BANK_SIZE + 1) * ROM_BANK_SIZE);
+        }
+        rom = romFile->data;
+        romBanks = romFile->size / ROM_BANK_SIZE;
+
+#ifdef VERBOSE
+        dumpCartridgeHeader(rom);
+#endif
+        type = mbcType(rom[0x147]);
+        sramSize = ramSize(rom[0x149]);
+        bool saveRTC = hasRTC(rom[0x147]) && hasBattery(rom[0x147]);
+        if ((sramSize || saveRTC) && hasBattery(rom[0x147]) && !saveFileName.empty()) {
+            saveFile = make_unique<MappedFile>(saveFileName, sramSize + (saveRTC ? RTC_TRAILER_SIZE : 0), true);
+            sram = saveFile->data;
+            if (saveRTC) {
+                rtcTrailer = sram + sramSize;
+                loadRTC();
+            }
+        } else {
+            volatileRAM.resize(sramSize, 0);
+            sram = volatileRAM.data();
+        }
+
+        for (int page = 0x00; page < 0x80; ++page) {
+            bus.setWriteHandler(page, [this](u16 addr, u8 val) {
+                writeControl(addr, val);
+            });
+        }
+        mapLowBank();
+        mapHighBank();
+        mapRAM();
+    }
+
+    static MBCType mbcType(u8 cartridgeType) {
+        switch (cartridgeType) {
+            case 0x00:
+            case 0x08:
+            case 0x09:
+                return ROM_ONLY;
+            case 0x01:
+            case 0x02:
+            case 0x03:
+                return MBC1;
+            case 0x0F:
+            case 0x10:
+            case 0x11:
+            case 0x12:
+            case 0x13:
+                return MBC3;
+            case 0x19:
+            case 0x1A:
+            case 0x1B:
+            case 0x1C:
+            case 0x1D:
+            case 0x1E:
+                return MBC5;
+            default:
+                throw "Cartridge type not supported";
+        }
+    }
+
+    static bool hasBattery(u8 cartridgeType) {
+        switch (cartridgeType) {
+            case 0x03:
+            case 0x09:
+            case 0x0F:
+            case 0x10:
+            case 0x13:
+            case 0x1B:
+            case 0x1E:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    static bool hasRTC(u8 cartridgeType) {
+        return cartridgeType == 0x0F || cartridgeType == 0x10;
+    }
+
+    // game.gb -> game.sav
+    static string savePath(const string &cartridgeROM) {
+        size_t dot = cartridgeROM.find_last_of('.');
+        size_t slash = cartridgeROM.find_last_of('/');
+        if (dot == string::npos || (slash != string::npos && dot < slash)) {
+            return cartridgeROM + ".sav";
+        }
+        return cartridgeROM.substr(0, dot) + ".sav";
+    }
+
+    static size_t ramSize(u8 ramSizeType) {
+        switch (ramSizeType) {
+            case 0x01:
+                return 0x800;
+            case 0x02:
+                return 0x2000;
+            case 0x03:
+                return 0x8000;
+            case 0x04:
+                return 0x20000;
+            case 0x05:
+                return 0x10000;
+            default:
+                return 0;
+        }
+    }
+
+    void writeControl(u16 addr, u8 val) {
+        switch (type) {
+            case ROM_ONLY:
+                break;
+            case MBC1:
+                if (addr < 0x2000) {
+                    ramEnabled = (val & 0xF) == 0xA;
+                    mapRAM();
+                } else if (addr < 0x4000) {
+                    romBank = max(val & 0x1F, 1);
+                    mapHighBank();
+                } else if (addr < 0x6000) {
+                    bankHi = val & 0x3;
+                    mapHighBank();
+                    if (advancedBanking) {
+                        mapLowBank();
+                        mapRAM();
+                    }
+                } else {
+                    advancedBanking = val & 0x1;
+                    mapLowBank();
+                    mapRAM();
+                }
+                break;
+            case MBC3:
+                if (addr < 0x2000) {
+                    ramEnabled = (val & 0xF) == 0xA;
+                    mapRAM();
+                } else if (addr < 0x4000) {
+                    romBank = max(val & 0x7F, 1);
+                    mapHighBank();
+                } else if (addr < 0x6000) {
+                    ramBank = val & 0xF;
+                    mapRAM();
+                } else {
+                    if (lastLatchWrite == 0 && val == 1) {
+                        tickRTC();
+                        rtcLatched = rtc;
+                        storeRTC();
+                    }
+                    lastLatchWrite = val;
+                }
+                break;
+            case MBC5:
+                if (addr < 0x2000) {
+                    ramEnabled = (val & 0xF) == 0xA;
+                    mapRAM();
+                } else if (addr < 0x3000) {
+                    romBank = (romBank & 0x100) | val;
+                    mapHighBank();
+                } else if (addr < 0x4000) {
+                    romBank = (romBank & 0xFF) | (u16(val & 0x1) << 8);
+                    mapHighBank();
+                } else if (addr < 0x6000) {
+                    ramBank = val & 0xF;
+                    mapRAM();
+                }
+                break;
+        }
+    }
+
+    // also used to take the boot rom out of 0x0000-0x00FF
+    void mapLowBank() {
+        u16 bank = type == MBC1 && advancedBanking ? (bankHi << 5) % romBanks : 0;
+        for (int page = 0x00; page < 0x40; ++page) {
+            bus.mapReadOnly(page, &rom[bank * ROM_BANK_SIZE + (page << 8)]);
+        }
+    }
+
+    void mapHighBank() {
+        u16 bank = type == MBC1 ? (bankHi << 5) | romBank : romBank;
+        bus.mapROMBank(bank % romBanks, &rom[(bank % romBanks) * ROM_BANK_SIZE]);
+    }
+
+    void mapRAM() {
+        u8 bank = type == MBC1 ? (advancedBanking ? bankHi : 0) : ramBank;
+        if (type == MBC3 && bank >= 0x08 && bank <= 0x0C) {
+            mapRTC(bank - 0x08);
+            return;
+        }
+        for (int page = 0xA0; page < 0xC0; ++page) {
+            if (ramEnabled && sramSize) {
+                bus.mapMemory(page, &sram[(bank * RAM_BANK_SIZE + ((page - 0xA0) << 8)) % sramSize]);
+            } else {
+                bus.setReadHandler(page, [](u16) -> u8 { return 0xFF; });
+                bus.setWriteHandler(page, [](u16, u8) {});
+            }
+        }
+    }
+
+    void mapRTC(int reg) {
+        for (int page = 0xA0; page < 0xC0; ++page) {
+            bus.setReadHandler(page, [this, reg](u16) -> u8 {
+                return ramEnabled ? rtcLatched[reg] : 0xFF;
+            });
+            bus.setWriteHandler(page, [this, reg](u16, u8 val) {
+                if (ramEnabled) {
+                    tickRTC();
+                    rtc[reg] = val;
+                    rtcLatched[reg] = val;
+                    storeRTC();
+                }
+            });
+        }
+    }
+
+    // moves the clock registers forward by the wall time since they were last brought up to date
+    void tickRTC() {
+        time_t now = time(nullptr);
+        if (rtc[RTC_DH] & 0x40) {
+            // halted
+            rtcUpdated = now;
+            storeRTC();
+            return;
+        }
+        uint64_t days = (u16(rtc[RTC_DH] & 0x1) << 8) | rtc[RTC_DL];
+        uint64_t total = rtc[RTC_S] + 60 * (rtc[RTC_M] + 60 * (rtc[RTC_H] + 24 * days)) + (now - rtcUpdated);
+        rtcUpdated = now;
+
+        rtc[RTC_S] = total % 60;
+        total /= 60;
+        rtc[RTC_M] = total % 60;
+        total /= 60;
+        rtc[RTC_H] = total % 24;
+        total /= 24;
+        if (total > 0x1FF) {
+            rtc[RTC_DH] |= 0x80; // day counter carry
+            total &= 0x1FF;
+        }
+        rtc[RTC_DL] = total & 0xFF;
+        rtc[RTC_DH] = (rtc[RTC_DH] & 0xFE) | (total >> 8);
+        storeRTC();
+    }
+
+    // the clock as it was when the game last ran, caught up by the time since. A trailer of zeroes is a new save
+    // or one written before the clock was kept, that starts from 0 now
+    void loadRTC() {
+        uint64_t savedAt = 0;
+        for (int i = 7; i >= 0; --i) {
+            savedAt = (savedAt << 8) | rtcTrailer[40 + i];
+        }
+        if (!savedAt) {
+            storeRTC();
+            return;
+        }
+        for (int i = 0; i < 5; ++i) {
+            rtc[i] = rtcTrailer[4 * i];
+            rtcLatched[i] = rtcTrailer[20 + 4 * i];
+        }
+        rtcUpdated = time_t(savedAt);
+        tickRTC();
+    }
+
+    // the save file is mapped, so this is all it takes for the clock to outlive the run
+    void storeRTC() {
+        if (!rtcTrailer) {
+            return;
+        }
+        fill(rtcTrailer, rtcTrailer + RTC_TRAILER_SIZE, 0);
+        for (int i = 0; i < 5; ++i) {
+            rtcTrailer[4 * i] = rtc[i];
+            rtcTrailer[20 + 4 * i] = rtcLatched[i];
+        }
+        for (int i = 0; i < 8; ++i) {
+            rtcTrailer[40 + i] = uint64_t(rtcUpdated) >> (8 * i);
+        }
+    }
+
+    [[nodiscard]] string title() const {
+        string title(reinterpret_cast<const char *>(&rom[0x134]), 16);
+        title.erase(find(title.begin(), title.end(), '\0'), title.end());
+        return title;
+    }
+};
+
 class Joypad {
 public:
     using Scancode = sf::Keyboard::Scancode;
@@ -94,13 +670,12 @@ public:
     };
     vector<u8> &ram;
     u8 &jReg;
-    InterruptFlag &ifReg;
+    InterruptController &irq;
 
     std::set<Scancode> interestKeys;
     std::map<Scancode, JoypadBit> keyMap;
 
-    Joypad(vector<u8> &ram) : ram{ram}, jReg{ram[0xFF00]},
-                              ifReg{*reinterpret_cast<InterruptFlag *>(ram[0xFF0F])} {
+    Joypad(vector<u8> &ram, InterruptController &irq) : ram{ram}, jReg{ram[0xFF00]}, irq{irq} {
         std::vector<Scancode> events = {Scancode::A, Scancode::B, Scancode::P, Scancode::L, Scancode::Left,
                                         Scancode::Right,
                                         Scancode::Up, Scancode::Down};
@@ -130,7 +705,7 @@ public:
                 } else {
                     jReg = jReg & ~(1 << key.column | 1 << key.row);
                 }
-                ifReg.joypad = true;
+                irq.request(InterruptController::JOYPAD);
             }
         }
 
@@ -140,6 +715,8 @@ public:
 
 class CPU {
 public:
+    using OpHandler = void (*)(CPU &);
+
     u8 registers[8];
     u8 &a = registers[1];
     FlagReg &f = (FlagReg &) registers[0];
@@ -159,29 +736,44 @@ public:
 
     uint64_t clock;
 
-    vector<u8> &vram;
+    Bus &bus;
 
-    bool ime;
+    InterruptController &irq;
+    bool imePending; // EI takes effect after the following instruction
+    bool halted;
+    bool stopped;
 
-    InterruptFlag &ifReg;
-    InterruptEnable &ieReg;
+    // operands of the last flag-setting ALU operation, f is only brought up to date when read
+    u8 flagOp;
+    u8 flagLhs;
+    u8 flagRhs;
+    u16 flagResult;
+    bool flagCarryIn;
 
-    CPU(vector<u8> &vram) : vram{vram}, clock{0}, ime{false},
-                            ifReg{*reinterpret_cast<InterruptFlag *>(&vram[0xFF0F])},
-                            ieReg{*reinterpret_cast<InterruptEnable *>(&vram[0xFFFF])} {
+    // B, C, D, E, H, L, (HL), A as encoded in the opcode bits
+    constexpr static u8 R8_INDEX[8] = {3, 2, 5, 4, 7, 6, 255, 1};
+
+    static const array<OpHandler, 256> opTable;
+    static const array<OpHandler, 256> cbTable;
+
+    CPU(Bus &bus, InterruptController &irq) : bus{bus}, clock{0}, irq{irq}, imePending{false},
+                                                      halted{false}, stopped{false},
+                            flagOp{FLAGS_CLEAN}, flagLhs{0}, flagRhs{0}, flagResult{0}, flagCarryIn{false} {
         initializeRegisters();
         clock = 0;
 
-        vram[0xFF40] = 0x91;
-        vram[0xFF42] = 0x00;
-        vram[0xFF43] = 0x00;
-        vram[0xFF45] = 0x00;
-        vram[0xFF47] = 0xFC;
-        vram[0xFF48] = 0xFF;
-        vram[0xFF49] = 0xFF;
-        vram[0xFF4A] = 0x00;
-        vram[0xFF4B] = 0x00;
-        vram[0xFFFF] = 0x00;
+        vector<u8> &ram = bus.ram;
+        ram[0xFF40] = 0x91;
+        ram[0xFF42] = 0x00;
+        ram[0xFF43] = 0x00;
+        ram[0xFF45] = 0x00;
+        ram[0xFF47] = 0xFC;
+        ram[0xFF48] = 0xFF;
+        ram[0xFF49] = 0xFF;
+        ram[0xFF4A] = 0x00;
+        ram[0xFF4B] = 0x00;
+        ram[0xFFFF] = 0x00;
+        irq.update();
     }
 
     void initializeRegisters() {
@@ -193,958 +785,768 @@ public:
         pc = 0x0000;
     }
 
+    // only needs calling while irq.pending is set
     void processInterrupts() {
-        if (ime) {
-            ime = false;
-            // if reset
-            u16 jumpAddr = 0x0;
-            if (ifReg.vBlank && ieReg.vBlank) {
-                ifReg.vBlank = false;
-                jumpAddr = 0x40;
-            } else if (ifReg.lcdStat && ieReg.lcdStat) {
-                ifReg.lcdStat = false;
-                jumpAddr = 0x48;
-            } else if (ifReg.timer && ieReg.timer) {
-                ifReg.timer = false;
-                jumpAddr = 0x50;
-            } else if (ifReg.serial && ieReg.serial) {
-                ifReg.serial = false;
-                jumpAddr = 0x58;
-            } else if (ifReg.joypad && ieReg.joypad) {
-                ifReg.joypad = false;
-                jumpAddr = 0x60;
-            }
-
-            if (jumpAddr) {
-                vram[--sp] = pc >> 8;
-                vram[--sp] = pc & 0xff;
-                pc = jumpAddr;
+        if (halted) {
+            // STOP is only left through the joypad
+            if (stopped && !(irq.ifReg & InterruptController::JOYPAD)) {
+                return;
             }
+            halted = false;
+            stopped = false;
+        }
+        if (irq.serviceable) {
+            // lowest bit has the highest priority
+            int interrupt = __builtin_ctz(irq.serviceable);
+            irq.ime = false;
+            irq.acknowledge(1 << interrupt);
+            push16(pc);
+            pc = 0x40 + 8 * interrupt;
+            clock += 20;
         }
     }
 
     void fetchDecodeExecute() {
-        u8 r[8] = {3, 2, 5, 4, 7, 6, 255, 1};
-        u8 opcode = vram[pc];
-        switch (opcode) {
+        if (imePending) {
+            imePending = false;
+            irq.setIme(true);
+        }
+        if (halted) {
+            clock += 4;
+            return;
+        }
+        opTable[read8(pc)](*this);
+    }
 
-            case 0x01: // ld sp 0x
-                clock += 12;
-                bc = (u16 &) (vram[pc + 1]);
-                pc += 3;
-                break;
+    u8 read8(u16 addr) const {
+        return bus.read8(addr);
+    }
 
-            case 0x11:
-                clock += 12;
-                de = (u16 &) (vram[pc + 1]);
-                pc += 3;
-                break;
+    void write8(u16 addr, u8 val) {
+        bus.write8(addr, val);
+    }
 
-            case 0x21:
-                clock += 12;
-                hl = (u16 &) (vram[pc + 1]);
-                pc += 3;
-                break;
+    u16 read16(u16 addr) const {
+        return (u16(read8(addr + 1)) << 8) | read8(addr);
+    }
 
-            case 0x31:
-                clock += 12;
-                sp = (u16 &) (vram[pc + 1]);
-                pc += 3;
-                break;
+    void push16(u16 val) {
+        write8(--sp, val >> 8);
+        write8(--sp, val & 0xff);
+    }
 
-            case 0x32:
-                clock += 8;
-                vram[hl--] = a;
-                ++pc;
-                break;
+    u16 pop16() {
+        u16 lower = read8(sp++);
+        u16 upper = read8(sp++);
+        return (upper << 8) | lower;
+    }
 
-            case 0x20: {
-                if (!f.zf) {
-                    int8_t relativeOffset = vram[pc + 1];
-                    pc = pc + 2 + relativeOffset;
-                    clock += 12;
-                } else {
-                    pc += 2;
-                    clock += 8;
-                }
-                break;
-            }
+    void setFlags(bool z, bool n, bool hc, bool cy) {
+        flagOp = FLAGS_CLEAN;
+        registers[0] = (z << 7) | (n << 6) | (hc << 5) | (cy << 4);
+    }
 
-            case 0xCB:
-                switch (vram[pc + 1]) {
-                    case 0x7C:
-                        clock += 4;
-                        f.zf = h >> 7;
-                        f.h = true;
-                        pc += 2;
-                        break;
-                    case 0x10:
-                    case 0x11:
-                    case 0x12:
-                    case 0x13:
-                    case 0x14:
-                    case 0x15:
-                    case 0x17: {
-                        clock += 4;
-
-                        u8 &reg = registers[r[vram[pc + 1] - 0x10]];
-
-                        bool carryFlag = reg >> 7;
-                        reg = (reg << 1) | f.cy;
-                        f.zf = reg == 0;
-                        f.n = false;
-                        f.h = false;
-                        f.cy = carryFlag;
-                        pc += 2;
-                        break;
-                    }
-                    case 0x30:
-                    case 0x31:
-                    case 0x32:
-                    case 0x33:
-                    case 0x34:
-                    case 0x35:
-                    case 0x37: {
-                        u8 op = vram[pc + 1];
-                        u8 &reg = registers[r[op]];
-                        reg = ((reg & 0xf) << 4) | (reg >> 4);
-                        f.zf = reg == 0;
-                        f.n = false;
-                        f.h = false;
-                        f.cy = false;
-                        clock += 8;
-                        pc += 2;
-                        break;
-                    }
-                    case 0x36: {
-                        u8 &reg = vram[hl];
-                        reg = ((reg & 0xf) << 4) | (reg >> 4);
-                        f.zf = reg == 0;
-                        f.n = false;
-                        f.h = false;
-                        f.cy = false;
-                        clock += 8;
-                        pc += 2;
-                        break;
+    void recordFlags(u8 op, u8 lhs, u8 rhs, u16 result, bool carryIn) {
+        flagOp = op;
+        flagLhs = lhs;
+        flagRhs = rhs;
+        flagResult = result;
+        flagCarryIn = carryIn;
+#ifndef LAZY_FLAGS
+        syncFlags();
+#endif
+    }
 
-                    }
-                    default:
-                        printf("CB - Opcode not implemented: [%x]", vram[pc + 1]);
-                        exit(1);
-                }
-                break;
-            case 0xA0:
-                clock += 4;
-                a = a & b;
-                f.h = true;
-                f.zf = a == 0;
-                ++pc;
-                break;
-            case 0xA1:
-                clock += 4;
-                a = a & c;
-                f.h = true;
-                f.zf = a == 0;
-                ++pc;
-                break;
-            case 0xA2:
-                clock += 4;
-                a = a & d;
-                f.h = true;
-                f.zf = a == 0;
-                ++pc;
-                break;
-            case 0xA3:
-                clock += 4;
-                a = a & e;
-                f.h = true;
-                f.zf = a == 0;
-                ++pc;
-                break;
-            case 0xA4:
-                clock += 4;
-                a = a & h;
-                f.h = true;
-                f.zf = a == 0;
-                ++pc;
-                break;
-            case 0xA5:
-                clock += 4;
-                a = a & l;
-                f.h = true;
-                f.zf = a == 0;
-                ++pc;
-                break;
-            case 0xA6:
-                clock += 8;
-                a = a & vram[hl];
-                f.h = true;
-                f.zf = a == 0;
-                ++pc;
+    void syncFlags() {
+        switch (flagOp) {
+            case FLAGS_CLEAN:
+                return;
+            case FLAGS_ADD:
+                setFlags((flagResult & 0xff) == 0, false, (flagLhs & 0xf) + (flagRhs & 0xf) + flagCarryIn > 0xf,
+                         flagResult > 0xff);
                 break;
-            case 0xA7:
-                clock += 4;
-                a = a & a;
-                f.h = true;
-                f.zf = a == 0;
-                ++pc;
+            case FLAGS_SUB:
+                setFlags((flagResult & 0xff) == 0, true, (flagLhs & 0xf) - (flagRhs & 0xf) - flagCarryIn < 0,
+                         flagResult > 0xff);
                 break;
-            case 0xA8:
-                clock += 4;
-                a = a ^ b;
-                f.zf = a == 0;
-                ++pc;
+            case FLAGS_AND:
+                setFlags(flagResult == 0, false, true, false);
                 break;
-            case 0xA9:
-                clock += 4;
-                a = a ^ c;
-                f.zf = a == 0;
-                ++pc;
+            case FLAGS_OR:
+                setFlags(flagResult == 0, false, false, false);
                 break;
-            case 0xAA:
-                clock += 4;
-                a = a ^ d;
-                f.zf = a == 0;
-                ++pc;
+            case FLAGS_INC:
+                setFlags(flagResult == 0, false, (flagLhs & 0xf) == 0xf, flagCarryIn);
                 break;
-            case 0xAB:
-                clock += 4;
-                a = a ^ e;
-                f.zf = a == 0;
-                ++pc;
-                break;
-            case 0xAC:
-                clock += 4;
-                a = a ^ h;
-                f.zf = a == 0;
-                ++pc;
-                break;
-            case 0xAD:
-                clock += 4;
-                a = a ^ l;
-                f.zf = a == 0;
-                ++pc;
-                break;
-            case 0xAE:
-                clock += 8;
-                a = a ^ vram[hl];
-                f.zf = a == 0;
-                ++pc;
-                break;
-            case 0xAF:
-                clock += 4;
-                a = a ^ a;
-                f.zf = a == 0;
-                ++pc;
-                break;
-            case 0x0E: {
-                clock += 8;
-                u8 d8 = vram[pc + 1];
-                c = d8;
-                pc += 2;
-                break;
-            }
-            case 0x1E: {
-                clock += 8;
-                u8 d8 = vram[pc + 1];
-                e = d8;
-                pc += 2;
-                break;
-            }
-            case 0x2E: {
-                clock += 8;
-                u8 d8 = vram[pc + 1];
-                l = d8;
-                pc += 2;
-                break;
-            }
-            case 0x3E: {
-                clock += 8;
-                u8 d8 = vram[pc + 1];
-                a = d8;
-                pc += 2;
-                break;
-            }
-            case 0xE0: {
-                clock += 12;
-                vram[0xFF00 + vram[pc + 1]] = a;
-                pc += 2;
-                break;
-            }
-            case 0xE2: {
-                clock += 8;
-                vram[0xFF00 + c] = a;
-                ++pc;
+            case FLAGS_DEC:
+                setFlags(flagResult == 0, true, (flagLhs & 0xf) == 0, flagCarryIn);
                 break;
+        }
+    }
+
+    [[nodiscard]] bool zeroFlag() const {
+        return flagOp == FLAGS_CLEAN ? f.zf : (flagResult & 0xff) == 0;
+    }
+
+    [[nodiscard]] bool carryFlag() const {
+        switch (flagOp) {
+            case FLAGS_CLEAN:
+                return f.cy;
+            case FLAGS_ADD:
+            case FLAGS_SUB:
+                return flagResult > 0xff;
+            case FLAGS_INC:
+            case FLAGS_DEC:
+                return flagCarryIn;
+            default:
+                return false;
+        }
+    }
+
+    template<u8 R>
+    u8 getR8() const {
+        if constexpr (R == 6) {
+            return read8(hl);
+        } else {
+            return registers[R8_INDEX[R]];
+        }
+    }
+
+    template<u8 R>
+    void setR8(u8 val) {
+        if constexpr (R == 6) {
+            write8(hl, val);
+        } else {
+            registers[R8_INDEX[R]] = val;
+        }
+    }
+
+    // BC, DE, HL, SP
+    template<u8 P>
+    u16 &r16() {
+        if constexpr (P == 0) {
+            return bc;
+        } else if constexpr (P == 1) {
+            return de;
+        } else if constexpr (P == 2) {
+            return hl;
+        } else {
+            return sp;
+        }
+    }
+
+    // NZ, Z, NC, C
+    template<u8 CC>
+    bool condition() const {
+        if constexpr (CC == 0) {
+            return !zeroFlag();
+        } else if constexpr (CC == 1) {
+            return zeroFlag();
+        } else if constexpr (CC == 2) {
+            return !carryFlag();
+        } else {
+            return carryFlag();
+        }
+    }
+
+    // ADD, ADC, SUB, SBC, AND, XOR, OR, CP
+    template<u8 OP>
+    void alu(u8 val) {
+        if constexpr (OP == 0 || OP == 1) {
+            bool carry = OP == 1 && carryFlag();
+            u16 result = a + val + carry;
+            recordFlags(FLAGS_ADD, a, val, result, carry);
+            a = result;
+        } else if constexpr (OP == 2 || OP == 3 || OP == 7) {
+            bool carry = OP == 3 && carryFlag();
+            u16 result = a - val - carry;
+            recordFlags(FLAGS_SUB, a, val, result, carry);
+            if constexpr (OP != 7) {
+                a = result;
             }
-            case 0x0C:
-            case 0x1C:
-            case 0x2C:
-            case 0x3C: {
-                u8 m[4] = {2, 4, 6, 1};
-                u8 &reg = registers[m[(opcode >> 4)]];
-                clock += 4;
-                f.zf = (reg + 1) == 0;
-                f.n = false;
-                f.h = (reg & 0xf) == 0xf;
-                ++reg;
-                ++pc;
-                break;
+        } else if constexpr (OP == 4) {
+            a &= val;
+            recordFlags(FLAGS_AND, 0, 0, a, false);
+        } else if constexpr (OP == 5) {
+            a ^= val;
+            recordFlags(FLAGS_OR, 0, 0, a, false);
+        } else {
+            a |= val;
+            recordFlags(FLAGS_OR, 0, 0, a, false);
+        }
+    }
+
+    // RLC, RRC, RL, RR, SLA, SRA, SWAP, SRL
+    template<u8 OP>
+    u8 shift(u8 val) {
+        u8 result;
+        bool carry;
+        if constexpr (OP == 0) {
+            carry = val >> 7;
+            result = (val << 1) | carry;
+        } else if constexpr (OP == 1) {
+            carry = val & 1;
+            result = (val >> 1) | (carry << 7);
+        } else if constexpr (OP == 2) {
+            carry = val >> 7;
+            result = (val << 1) | carryFlag();
+        } else if constexpr (OP == 3) {
+            carry = val & 1;
+            result = (val >> 1) | (carryFlag() << 7);
+        } else if constexpr (OP == 4) {
+            carry = val >> 7;
+            result = val << 1;
+        } else if constexpr (OP == 5) {
+            carry = val & 1;
+            result = (val >> 1) | (val & 0x80);
+        } else if constexpr (OP == 6) {
+            carry = false;
+            result = (val << 4) | (val >> 4);
+        } else {
+            carry = val & 1;
+            result = val >> 1;
+        }
+        setFlags(result == 0, false, false, carry);
+        return result;
+    }
+
+    void inc8(u8 &reg) {
+        recordFlags(FLAGS_INC, reg, 1, u8(reg + 1), carryFlag());
+        ++reg;
+    }
+
+    void dec8(u8 &reg) {
+        recordFlags(FLAGS_DEC, reg, 1, u8(reg - 1), carryFlag());
+        --reg;
+    }
+
+    void addHL(u16 val) {
+        setFlags(zeroFlag(), false, (hl & 0xfff) + (val & 0xfff) > 0xfff, hl + val > 0xffff);
+        hl += val;
+    }
+
+    u16 addSPRelative(u8 operand) {
+        setFlags(false, false, (sp & 0xf) + (operand & 0xf) > 0xf, (sp & 0xff) + operand > 0xff);
+        return sp + static_cast<int8_t>(operand);
+    }
+
+    void daa() {
+        syncFlags();
+        u8 adjust = 0;
+        bool carry = f.cy;
+        if (!f.n) {
+            if (f.cy || a > 0x99) {
+                adjust |= 0x60;
+                carry = true;
             }
-            case 0x0D:
-            case 0x1D:
-            case 0x2D:
-            case 0x3D: {
-                u8 m[4] = {2, 4, 6, 1};
-                u8 &reg = registers[m[(opcode >> 4)]];
-                clock += 4;
-                f.zf = (reg - 1) == 0;
-                f.n = true;
-                f.h = (reg & 0xf) == 0x0;
-                --reg;
-                ++pc;
-                break;
+            if (f.h || (a & 0xf) > 0x9) {
+                adjust |= 0x06;
             }
-            case 0x70: {
-                clock += 8;
-                vram[hl] = b;
-                ++pc;
-                break;
+            a += adjust;
+        } else {
+            if (f.cy) {
+                adjust |= 0x60;
             }
-            case 0x71: {
-                clock += 8;
-                vram[hl] = c;
-                ++pc;
-                break;
+            if (f.h) {
+                adjust |= 0x06;
             }
-            case 0x72: {
-                clock += 8;
-                vram[hl] = d;
-                ++pc;
-                break;
-            }
-            case 0x73: {
-                clock += 8;
-                vram[hl] = e;
-                ++pc;
-                break;
-            }
-            case 0x74: {
-                clock += 8;
-                vram[hl] = h;
-                ++pc;
-                break;
-            }
-            case 0x75: {
-                clock += 8;
-                vram[hl] = l;
-                ++pc;
-                break;
-            }
-            case 0x77: {
-                clock += 8;
-                vram[hl] = a;
-                ++pc;
-                break;
-            }
-            case 0x0A: {
-                clock += 8;
-                a = vram[bc];
-                ++pc;
-                break;
-            }
-            case 0x1A: {
-                clock += 8;
-                a = vram[de];
-                ++pc;//
-// Created by jc on 24/09/23.
-//
+            a -= adjust;
+        }
+        setFlags(a == 0, f.n, false, carry);
+    }
 
+    void illegalOpcode(u8 opcode) {
+        printf("Opcode not implemented: [%x]", opcode);
+        exit(1);
+    }
 
-                break;
-            }
-            case 0xCD: {
-                clock += 24;
-                u16 jumpAddr = ((u16) (vram[pc + 2]) << 8) | (vram[pc + 1]);
-                vram[--sp] = (pc + 3) >> 8;
-                vram[--sp] = (pc + 3) & 0xff;
-                pc = jumpAddr;
-                break;
-            }
-            case 0x03: {
-                clock += 8;
-                ++bc;
-                ++pc;
-                break;
-            }
-            case 0x13: {
-                clock += 8;
-                ++de;
-                ++pc;
-                break;
-            }
-            case 0x23: {
-                clock += 8;
-                ++hl;
-                ++pc;
-                break;
-            }
-            case 0x33: {
-                clock += 8;
-                ++sp;
-                ++pc;
-                break;
-            }
-            case 0x40: {
-                clock += 4;
-                b = b;
-                ++pc;
-                break;
-            }
-            case 0x41: {
-                clock += 4;
-                b = c;
-                ++pc;
-                break;
-            }
-            case 0x42: {
-                clock += 4;
-                b = d;
-                ++pc;
-                break;
-            }
-            case 0x43: {
-                clock += 4;
-                b = e;
-                ++pc;
-                break;
-            }
-            case 0x44: {
-                clock += 4;
-                b = h;
-                ++pc;
-                break;
-            }
-            case 0x45: {
-                clock += 4;
-                b = l;
-                ++pc;
-                break;
-            }
-            case 0x50: {
-                clock += 4;
-                d = b;
-                ++pc;
-                break;
-            }
-            case 0x51: {
-                clock += 4;
-                d = c;
-                ++pc;
-                break;
-            }
-            case 0x52: {
-                clock += 4;
-                d = d;
-                ++pc;
-                break;
-            }
-            case 0x53: {
-                clock += 4;
-                d = e;
-                ++pc;
-                break;
-            }
-            case 0x54: {
-                clock += 4;
-                d = h;
-                ++pc;
-                break;
-            }
-            case 0x55: {
-                clock += 4;
-                d = l;
-                ++pc;
-                break;
-            }
-            case 0x60: {
-                clock += 4;
-                h = b;
-                ++pc;
-                break;
-            }
-            case 0x61: {
-                clock += 4;
-                h = c;
-                ++pc;
-                break;
-            }
-            case 0x62: {
-                clock += 4;
-                h = d;
-                ++pc;
-                break;
-            }
-            case 0x63: {
-                clock += 4;
-                h = e;
-                ++pc;
-                break;
-            }
-            case 0x64: {
-                clock += 4;
-                h = h;
-                ++pc;
-                break;
-            }
-            case 0x65: {
-                clock += 4;
-                h = l;
-                ++pc;
-                break;
-            }
-            case 0x47: {
-                clock += 4;
-                b = a;
-                ++pc;
-                break;
-            }
-            case 0x57: {
-                clock += 4;
-                d = a;
-                ++pc;
-                break;
-            }
-            case 0x67: {
-                clock += 4;
-                h = a;
-                ++pc;
-                break;
-            }
-            case 0x48:
-            case 0x49:
-            case 0x4a:
-            case 0x4b:
-            case 0x4c:
-            case 0x4d:
-            case 0x4f:
-            case 0x58:
-            case 0x59:
-            case 0x5a:
-            case 0x5b:
-            case 0x5c:
-            case 0x5d:
-            case 0x5f:
-            case 0x68:
-            case 0x69:
-            case 0x6a:
-            case 0x6b:
-            case 0x6c:
-            case 0x6d:
-            case 0x6f:
-            case 0x78:
-            case 0x79:
-            case 0x7a:
-            case 0x7b:
-            case 0x7c:
-            case 0x7d:
-            case 0x7f: {
-                clock += 4;
-                u8 o[4] = {2, 4, 6, 1};
-                registers[o[(opcode >> 4) - 4]] = registers[r[(opcode & 0xf) - 0x8]];
-                ++pc;
-                break;
-            }
-            case 0xFE: {
-                clock += 8;
-                int res = a - vram[pc + 1];
-                f.zf = res == 0;
-                f.n = true;
-                f.h = (a & 0xf) < (vram[pc + 1] & 0xf);
-                f.cy = a < vram[pc + 1];
-                pc += 2;
-                break;
-            }
-            case 0x90:
-            case 0x91:
-            case 0x92:
-            case 0x93:
-            case 0x94:
-            case 0x95:
-            case 0x97: {
-                clock += 4;
-                u8 &opReg = registers[r[(opcode & 0xf)]];
-                u8 result = a - opReg;
-                f.zf = a == 0;
-                f.n = true;
-                f.h = (a & 0xf) < (opReg & 0xf);
-                f.cy = a < opReg;
-                a = result;
-                ++pc;
-                break;
-            }
-            case 0xF0: {
-                clock += 12;
-                a = vram[0xFF00 | vram[pc + 1]];
-                pc += 2;
-                break;
-            }
-            case 0x05: {
-                clock += 4;
-                u8 &reg = b;
-                f.zf = (reg - 1) == 0;
-                f.n = true;
-                f.h = (reg & 0xf) == 0;
-                --reg;
-                ++pc;
-                break;
-            }
-            case 0x15: {
-                clock += 4;
-                u8 &reg = d;
-                f.zf = (reg - 1) == 0;
-                f.n = true;
-                f.h = (reg & 0xf) == 0;
-                --reg;
-                ++pc;
-                break;
-            }
-            case 0x25: {
-                clock += 4;
-                u8 &reg = h;
-                f.zf = (reg - 1) == 0;
-                f.n = true;
-                f.h = (reg & 0xf) == 0;
-                --reg;
-                ++pc;
-                break;
-            }
-            case 0x06: {
-                clock += 8;
-                b = vram[pc + 1];
-                pc += 2;
-                break;
-            }
-            case 0x16: {
-                clock += 8;
-                d = vram[pc + 1];
-                pc += 2;
-                break;
-            }
-            case 0x26: {
-                clock += 8;
-                h = vram[pc + 1];
-                pc += 2;
-                break;
-            }
-            case 0x18: {
-                clock += 12;
-                pc = pc + 2 + (int8_t) (vram[pc + 1]);
-                break;
-            }
-            case 0xC5: {
-                clock += 16;
-                vram[--sp] = bc >> 8;
-                vram[--sp] = bc & 0xff;
-                ++pc;
-                break;
-            }
-            case 0xD5: {
-                clock += 16;
-                vram[--sp] = de >> 8;
-                vram[--sp] = de & 0xff;
-                ++pc;
-                break;
-            }
-            case 0xE5: {
-                clock += 16;
-                vram[--sp] = hl >> 8;
-                vram[--sp] = hl & 0xff;
-                ++pc;
-                break;
-            }
-            case 0xF5: {
-                clock += 16;
-                vram[--sp] = af >> 8;
-                vram[--sp] = af & 0xff;
-                ++pc;
-                break;
-            }
-            case 0x17: {
-                clock += 4;
-                u8 &reg = a;
-                bool carryFlag = reg >> 7;
-                reg = (reg << 1) | f.cy;
-                f.zf = false;
-                f.n = false;
-                f.h = false;
-                f.cy = carryFlag;
-                ++pc;
-                break;
-            }
-            case 0xC1:
-            case 0xD1:
-            case 0xE1:
-            case 0xF1: {
-                clock += 12;
-                bc = ((u16) (vram[sp + 1]) << 8) | vram[sp];
-                sp += 2;
-                ++pc;
-                break;
-            }
-            case 0x22: {
-                clock += 8;
-                vram[hl++] = a;
-                ++pc;
-                break;
-            }
-            case 0xC9: {
-                clock += 16;
-                pc = ((u16) vram[sp + 1] << 8) | vram[sp];
-                sp += 2;
-                break;
-            }
-            case 0xBE: {
-                clock += 8;
-                u8 data = vram[hl];
-                bool result = a - data;
-                f.zf = result == 0;
-                f.n = true;
-                f.h = (a & 0xf) < (data & 0xf);
-                f.cy = a < data;
-                ++pc;
-                break;
-            }
-            case 0x86: {
-                clock += 8;
-                u8 data = vram[hl];
-                u8 result = a + data;
-                f.zf = result == 0;
-                f.n = false;
-                f.h = (0xf - (a & 0xf)) > (data & 0xf);
-                f.cy = 0xff - a > data;
-                a = result;
-                ++pc;
-                break;
+    template<u8 OP>
+    static void execute(CPU &cpu) {
+        if constexpr (OP == 0xCB) {
+            cbTable[cpu.read8(cpu.pc + 1)](cpu);
+            return;
+        }
 
-            }
-            case 0xEA: {
-                u16 addr = ((u16) (vram[pc + 2]) << 8) | vram[pc + 1];
-                vram[addr] = a;
-                pc += 3;
-                clock += 8;
-                break;
-            }
-            case 0x28: {
-                auto relJump = static_cast<::int8_t>(vram[pc + 1]);
-                if (f.zf) {
-                    pc += 2 + relJump;
-                    clock += 12;
+        // opcode bits: xxyyyzzz, yyy = ppq
+        constexpr u8 x = OP >> 6;
+        constexpr u8 y = (OP >> 3) & 7;
+        constexpr u8 z = OP & 7;
+        constexpr u8 p = y >> 1;
+        constexpr u8 q = y & 1;
+        constexpr u8 branchCycles = OPCODE_CYCLES_BRANCH[OP] - OPCODE_CYCLES[OP];
+
+        u16 operand = cpu.pc + 1;
+        cpu.pc += OPCODE_LENGTH[OP];
+        cpu.clock += OPCODE_CYCLES[OP];
+
+        if constexpr (x == 1) {
+            if constexpr (OP == 0x76) {
+                cpu.halted = true;
+            } else {
+                cpu.setR8<y>(cpu.getR8<z>());
+            }
+        } else if constexpr (x == 2) {
+            cpu.alu<y>(cpu.getR8<z>());
+        } else if constexpr (x == 0) {
+            if constexpr (z == 0) {
+                if constexpr (y == 1) {
+                    u16 addr = cpu.read16(operand);
+                    cpu.write8(addr, cpu.sp & 0xff);
+                    cpu.write8(addr + 1, cpu.sp >> 8);
+                } else if constexpr (y == 2) {
+                    cpu.stopped = true;
+                    cpu.halted = true;
+                } else if constexpr (y == 3) {
+                    cpu.pc += static_cast<int8_t>(cpu.read8(operand));
+                } else if constexpr (y >= 4) {
+                    if (cpu.condition<y - 4>()) {
+                        cpu.pc += static_cast<int8_t>(cpu.read8(operand));
+                        cpu.clock += branchCycles;
+                    }
+                }
+            } else if constexpr (z == 1) {
+                if constexpr (q == 0) {
+                    cpu.r16<p>() = cpu.read16(operand);
                 } else {
-                    pc += 2;
-                    clock += 12;
+                    cpu.addHL(cpu.r16<p>());
                 }
-                break;
-            }
-            case 0x04:
-            case 0x14:
-            case 0x24: {
-                u8 ix[3] = {3, 5, 7};
-                u8 &reg = registers[ix[opcode >> 4]];
-                f.zf = (reg + 1 == 0);
-                f.n = false;
-                f.h = ((reg & 0xf) == 0xf);
-                ++reg;
-                ++pc;
-                clock += 4;
-                break;
-            }
-            case 0xc3: {
-                u16 updatedPC = ((u16) vram[pc + 2] << 8) | vram[pc + 1];
-                clock += 16;
-                pc = updatedPC;
-                break;
-            }
-            case 0xF3: {
-                ime = false;
-                ++pc;
-                clock += 4;
-                break;
-            }
-            case 0x36: {
-                vram[hl] = vram[pc + 1];
-                pc += 2;
-                clock += 12;
-                break;
-            }
-            case 0x2a: {
-                a = vram[hl++];
-                ++pc;
-                clock += 8;
-                break;
-            }
-            case 0x0B: {
-                --bc;
-                ++pc;
-                clock += 8;
-                break;
-            }
-            case 0xFB: {
-                ime = true;
-                ++pc;
-                clock += 4;
-                break;
-            }
-            case 0xC0: {
-                if (!f.zf) {
-                    u16 lower = vram[sp++];
-                    u16 upper = vram[sp++];
-                    u16 updated = (upper << 8) | lower;
-                    pc = updated;
-                    clock += 20;
+            } else if constexpr (z == 2) {
+                // (BC), (DE), (HL+), (HL-)
+                u16 addr = p == 0 ? cpu.bc : p == 1 ? cpu.de : p == 2 ? cpu.hl++ : cpu.hl--;
+                if constexpr (q == 0) {
+                    cpu.write8(addr, cpu.a);
                 } else {
-                    ++pc;
-                    clock += 8;
+                    cpu.a = cpu.read8(addr);
                 }
-                break;
-            }
-            case 0xFA: {
-                u8 a8 = vram[pc + 1];
-                a = vram[0xFF00 | a8];
-                pc += 2;
-                clock += 12;
-                break;
-            }
-            case 0xC8: {
-                if (f.zf) {
-                    u16 newAddr = (u16(vram[sp + 1]) << 8) | vram[sp];
-                    sp += 2;
-                    pc = newAddr;
-                    clock += 20;
+            } else if constexpr (z == 3) {
+                if constexpr (q == 0) {
+                    ++cpu.r16<p>();
                 } else {
-                    ++pc;
-                    clock += 8;
+                    --cpu.r16<p>();
+                }
+            } else if constexpr (z == 4 || z == 5) {
+                u8 val = cpu.getR8<y>();
+                if constexpr (z == 4) {
+                    cpu.inc8(val);
+                } else {
+                    cpu.dec8(val);
+                }
+                cpu.setR8<y>(val);
+            } else if constexpr (z == 6) {
+                cpu.setR8<y>(cpu.read8(operand));
+            } else {
+                if constexpr (y < 4) {
+                    cpu.a = cpu.shift<y>(cpu.a);
+                    cpu.f.zf = false;
+                } else if constexpr (y == 4) {
+                    cpu.daa();
+                } else if constexpr (y == 5) {
+                    cpu.a = ~cpu.a;
+                    cpu.setFlags(cpu.zeroFlag(), true, true, cpu.carryFlag());
+                } else {
+                    cpu.setFlags(cpu.zeroFlag(), false, false, y == 6 ? true : !cpu.carryFlag());
                 }
-                break;
-            }
-            case 0x34: {
-                f.h = (vram[hl] & 0xf) == 0xf;
-                u8 updatedVal = ++(vram[hl]);
-                ++pc;
-                clock += 12;
-                f.zf = updatedVal == 0;
-                f.n = false;
-                break;
-            }
-            case 0xD9: {
-                u16 updatedAddr = (u16(vram[sp + 1]) << 8) | vram[sp];
-                sp += 2;
-                ime = true;
-                pc = updatedAddr;
-                clock += 16;
-                break;
             }
-            case 0x2F: {
-                a = ~a;
-                ++pc;
-                f.n = true;
-                f.h = true;
-                clock += 4;
-                break;
+        } else {
+            if constexpr (z == 0) {
+                if constexpr (y < 4) {
+                    if (cpu.condition<y>()) {
+                        cpu.pc = cpu.pop16();
+                        cpu.clock += branchCycles;
+                    }
+                } else if constexpr (y == 4) {
+                    cpu.write8(0xFF00 | cpu.read8(operand), cpu.a);
+                } else if constexpr (y == 5) {
+                    cpu.sp = cpu.addSPRelative(cpu.read8(operand));
+                } else if constexpr (y == 6) {
+                    cpu.a = cpu.read8(0xFF00 | cpu.read8(operand));
+                } else {
+                    cpu.hl = cpu.addSPRelative(cpu.read8(operand));
+                }
+            } else if constexpr (z == 1) {
+                if constexpr (q == 0) {
+                    u16 val = cpu.pop16();
+                    if constexpr (p == 3) {
+                        cpu.af = val & 0xFFF0;
+                        cpu.flagOp = FLAGS_CLEAN;
+                    } else {
+                        cpu.r16<p>() = val;
+                    }
+                } else if constexpr (p == 0) {
+                    cpu.pc = cpu.pop16();
+                } else if constexpr (p == 1) {
+                    cpu.pc = cpu.pop16();
+                    cpu.irq.setIme(true);
+                } else if constexpr (p == 2) {
+                    cpu.pc = cpu.hl;
+                } else {
+                    cpu.sp = cpu.hl;
+                }
+            } else if constexpr (z == 2) {
+                if constexpr (y < 4) {
+                    if (cpu.condition<y>()) {
+                        cpu.pc = cpu.read16(operand);
+                        cpu.clock += branchCycles;
+                    }
+                } else if constexpr (y == 4) {
+                    cpu.write8(0xFF00 | cpu.c, cpu.a);
+                } else if constexpr (y == 5) {
+                    cpu.write8(cpu.read16(operand), cpu.a);
+                } else if constexpr (y == 6) {
+                    cpu.a = cpu.read8(0xFF00 | cpu.c);
+                } else {
+                    cpu.a = cpu.read8(cpu.read16(operand));
+                }
+            } else if constexpr (z == 3) {
+                if constexpr (y == 0) {
+                    cpu.pc = cpu.read16(operand);
+                } else if constexpr (y == 6) {
+                    cpu.irq.setIme(false);
+                    cpu.imePending = false;
+                } else if constexpr (y == 7) {
+                    cpu.imePending = true;
+                } else {
+                    cpu.illegalOpcode(OP);
+                }
+            } else if constexpr (z == 4) {
+                if constexpr (y < 4) {
+                    if (cpu.condition<y>()) {
+                        cpu.push16(cpu.pc);
+                        cpu.pc = cpu.read16(operand);
+                        cpu.clock += branchCycles;
+                    }
+                } else {
+                    cpu.illegalOpcode(OP);
+                }
+            } else if constexpr (z == 5) {
+                if constexpr (q == 0) {
+                    if constexpr (p == 3) {
+                        cpu.syncFlags();
+                    }
+                    cpu.push16(p == 3 ? cpu.af : cpu.r16<p>());
+                } else if constexpr (p == 0) {
+                    cpu.push16(cpu.pc);
+                    cpu.pc = cpu.read16(operand);
+                } else {
+                    cpu.illegalOpcode(OP);
+                }
+            } else if constexpr (z == 6) {
+                cpu.alu<y>(cpu.read8(operand));
+            } else {
+                cpu.push16(cpu.pc);
+                cpu.pc = y * 8;
             }
-            case 0xE6: {
-                u8 d8 = vram[pc + 1];
-                a = a & d8;
-                f.zf = a == 0;
-                f.n = false;
-                f.h = true;
-                f.cy = false;
-                pc += 2;
-                clock += 8;
+        }
+    }
 
-                break;
-            }
-            case 0xB0:
-            case 0xB1:
-            case 0xB2:
-            case 0xB3:
-            case 0xB4:
-            case 0xB5:
-            case 0xB7: {
-                u8 &reg = registers[r[opcode & 0xF]];
-                a = a | reg;
-                f.zf = a == 0;
-                f.n = false;
-                f.h = false;
-                f.cy = false;
-                ++pc;
-                clock += 4;
-                break;
-            }
-            case 0xCF:
-            case 0xDF:
-            case 0xEF:
-            case 0xFF: {
-                array<u8, 4> addrs = {0x08, 0x18, 0x28, 0x38};
-                u16 jmpAddr = vram[addrs[(opcode >> 4) - 0xC]];
-                u8 msb = pc & 0xf;
-                u8 lsb = pc >> 8;
-                vram[--sp] = msb;
-                vram[--sp] = lsb;
-                pc = jmpAddr;
-                clock += 16;
-                break;
-            }
-            case 0x09:
-            case 0x19:
-            case 0x29:
-            case 0x39: {
-                array<u16 *, 4> regs = {&bc, &de, &hl, &sp};
-                u16 reg = *regs[opcode >> 4];
-                ++pc;
-                clock += 8;
-                f.n = false;
-                f.h = (hl & 0xFF) >= 0xFF - (reg & 0xFF);
-                f.cy = hl >= 0xFFFF - reg;
-                hl += reg;
-                break;
-            }
-            case 0x0: {
-                pc += 1;
-                clock += 4;
-                break;
+    template<u8 OP>
+    static void executeCB(CPU &cpu) {
+        constexpr u8 x = OP >> 6;
+        constexpr u8 y = (OP >> 3) & 7;
+        constexpr u8 z = OP & 7;
+
+        cpu.pc += 2;
+        cpu.clock += CB_OPCODE_CYCLES[OP];
+
+        u8 val = cpu.getR8<z>();
+        if constexpr (x == 0) {
+            cpu.setR8<z>(cpu.shift<y>(val));
+        } else if constexpr (x == 1) {
+            cpu.setFlags(((val >> y) & 1) == 0, false, true, cpu.carryFlag());
+        } else if constexpr (x == 2) {
+            cpu.setR8<z>(val & ~(1 << y));
+        } else {
+            cpu.setR8<z>(val | (1 << y));
+        }
+    }
+
+};
+
+template<size_t... OPS>
+constexpr array<CPU::OpHandler, 256> makeOpTable(index_sequence<OPS...>) {
+    return {&CPU::execute<static_cast<u8>(OPS)>...};
+}
+
+template<size_t... OPS>
+constexpr array<CPU::OpHandler, 256> makeCBTable(index_sequence<OPS...>) {
+    return {&CPU::executeCB<static_cast<u8>(OPS)>...};
+}
+
+inline const array<CPU::OpHandler, 256> CPU::opTable = makeOpTable(make_index_sequence<256>{});
+inline const array<CPU::OpHandler, 256> CPU::cbTable = makeCBTable(make_index_sequence<256>{});
+
+// Translates hot runs of SM83 code into lists of pre-decoded handlers so the interpreter's fetch and table
+// lookup are paid once per block instead of once per instruction. This is threaded code, not host machine
+// code: each op is still a call into the interpreter's handler. A block runs on past conditional branches
+// and follows jr/jp/call to fixed targets within its two pages, each op knows where pc should be after it and
+// the block is left as soon as it isn't. A block that branches back to its own start loops without leaving,
+// unless it is an idle loop: then each pass goes back to runCPU so the skipper can jump over the rest.
+class BlockTranslator {
+public:
+    constexpr static u8 HOT_THRESHOLD = 16;
+    constexpr static int MAX_BLOCK_LEN = 32;
+    constexpr static int RECENT_BLOCKS = 1024;
+    constexpr static u32 ANYWHERE = 0x10000; // next of an op that ends the block
+
+    struct Op {
+        CPU::OpHandler handler;
+        u32 next; // pc when the block carries on after this op
+    };
+
+    struct Block {
+        vector<Op> ops;
+        u32 key;
+        u16 startPC;
+        u8 firstPage;
+        u8 lastPage; // the page after firstPage, code is only taken from these two
+        u32 firstPageVersion;
+        u32 lastPageVersion;
+        u16 bank;
+        bool banked;  // part of it is in 0x4000-0x7FFF
+        bool checked; // in ram or a switchable bank, so an op of the block can change the code after it
+        bool idle;    // starts an idle loop, left at the end of every pass
+    };
+
+    CPU &cpu;
+    unordered_map<u32, Block> blocks;
+    // direct-mapped in front of blocks, the loops that run most stay here and skip the hashing
+    array<Block *, RECENT_BLOCKS> recent;
+    // how often an address ran untranslated, only hot ones get a block. Banks share a counter, it's a heuristic
+    vector<u8> heat;
+
+    uint64_t blocksRun;
+    uint64_t instructionsRun;
+    u16 lastPC; // address of the last instruction step ran
+    function<bool(u16)> idleLoopAt; // whether the idle-loop skipper would take the loop starting there
+
+#ifdef DIFFERENTIAL_TEST
+    // saves what a block can change outside the cpu and ram, e.g. OAM DMA progress, the result puts it back
+    function<function<void()>()> saveDevices;
+#endif
+
+    BlockTranslator(CPU &cpu) : cpu{cpu}, recent{}, heat(0x10000, 0), blocksRun{0}, instructionsRun{0},
+                                lastPC{0} {
+    }
+
+    // while OAM DMA runs the cpu reads 0xFF everywhere below 0xFF00, so nothing is translated or run from there
+    void step(uint64_t deadline) {
+        if (cpu.halted || cpu.imePending || (cpu.bus.locked && cpu.pc < 0xFF00)) {
+            lastPC = cpu.pc;
+            cpu.fetchDecodeExecute();
+            return;
+        }
+
+        u32 key = blockKey(cpu.pc);
+        Block *block = find(key);
+        if (block && !block->ops.empty() && !isValid(*block)) {
+            block->ops.clear();
+        }
+        if (!block || block->ops.empty()) {
+            if (++heat[cpu.pc] < HOT_THRESHOLD) {
+                lastPC = cpu.pc;
+                cpu.fetchDecodeExecute();
+                return;
             }
-            case 0xFC: {
-                break;
+            heat[cpu.pc] = 0;
+            if (!block) {
+                block = &blocks[key];
+                block->key = key;
+                recent[key % RECENT_BLOCKS] = block;
             }
+            translate(cpu.pc, *block);
+        }
 
-/*
- *            case 0x19: {
+#ifdef DIFFERENTIAL_TEST
+        executeChecked(*block, deadline);
+#else
+        execute(*block, deadline);
+#endif
+    }
 
-                pc;
-                clock;
-                f;
-                sp;
-                break;
-            }
+    // doesn't add anything for addresses that were never translated
+    Block *find(u32 key) {
+        Block *&slot = recent[key % RECENT_BLOCKS];
+        if (slot && slot->key == key) {
+            return slot;
+        }
+        auto it = blocks.find(key);
+        if (it == blocks.end()) {
+            return nullptr;
+        }
+        slot = &it->second;
+        return slot;
+    }
 
- */
-            default: {
-                printf("Opcode not implemented: [%x]", opcode);
-                exit(1);
-            }
+    // leaves the block at the deadline, as soon as an interrupt can be taken (an IE/IF write or a reti), when an
+    // op wrote over or banked out the code that follows, when an OAM DMA hid it, or when a branch went somewhere
+    // the block doesn't
+    int execute(const Block &block, uint64_t deadline) {
+        ++blocksRun;
+        int executed = 0;
+        const Op *first = block.ops.data();
+        const Op *last = first + block.ops.size();
+        const u8 &serviceable = cpu.irq.serviceable;
+        const bool &locked = cpu.bus.locked;
+        bool checked = block.checked;
+        bool hideable = block.firstPage != 0xFF;
+        const Op *op = first;
+        while (true) {
+            op->handler(cpu);
+            ++executed;
+            if (cpu.clock > deadline || serviceable || (hideable && locked) || (checked && !isValid(block))) {
+                break;
+            }
+            if (cpu.pc == op->next && ++op != last) {
+                continue;
+            }
+            // back at the start is another pass, anywhere else is the end
+            if (cpu.pc != block.startPC || cpu.halted || cpu.imePending || block.idle) {
+                break;
+            }
+            op = first;
+        }
+        lastPC = op == first ? block.startPC : op[-1].next;
+        instructionsRun += executed;
+        return executed;
+    }
+
+    [[nodiscard]] u16 bankAt(u16 addr) const {
+        return addr >= 0x4000 && addr < 0x8000 ? cpu.bus.romBank : 0;
+    }
+
+    [[nodiscard]] u32 blockKey(u16 addr) const {
+        return (u32(bankAt(addr)) << 16) | addr;
+    }
+
+    // the bank check catches code that switches away the bank it is running from
+    [[nodiscard]] bool isValid(const Block &block) const {
+        return cpu.bus.pageVersion[block.firstPage] == block.firstPageVersion &&
+               cpu.bus.pageVersion[block.lastPage] == block.lastPageVersion &&
+               (!block.banked || cpu.bus.romBank == block.bank);
+    }
+
+    // control flow the block can't carry on past
+    constexpr static bool endsBlock(u8 opcode) {
+        switch (opcode) {
+            case 0x10: // stop
+            case 0x76: // halt
+            case 0xE9: // jp hl
+            case 0xC9: // ret
+            case 0xD9: // reti
+            case 0xFB: // ei
+                return true;
+            default:
+                // rst and the unused opcodes
+                return (opcode & 0xC7) == 0xC7 || OPCODE_CYCLES[opcode] == 0;
         }
     }
 
-    void cpuFunc(u8 clockInc, u16 pcUpdate, FlagReg &flags, function<void()> func) {
-        func();
-        clock += clockInc;
-        pc = pcUpdate;
-        f = flags;
+    [[nodiscard]] static bool inBlock(const Block &block, u32 addr) {
+        return addr <= 0xFFFF && (addr >> 8 == block.firstPage || addr >> 8 == block.lastPage);
+    }
+
+    void translate(u16 startPC, Block &block) {
+        block.ops.clear();
+        block.startPC = startPC;
+        block.firstPage = startPC >> 8;
+        block.lastPage = block.firstPage == 0xFF ? 0xFF : block.firstPage + 1;
+        u32 addr = startPC;
+        for (int i = 0; i < MAX_BLOCK_LEN; ++i) {
+            u8 opcode = cpu.read8(addr);
+            u32 next = addr + OPCODE_LENGTH[opcode];
+            // the first instruction is always taken, the block would be empty otherwise
+            if (i > 0 && !inBlock(block, next - 1)) {
+                break;
+            }
+            CPU::OpHandler handler = opcode == 0xCB ? CPU::cbTable[cpu.read8(addr + 1)] : CPU::opTable[opcode];
+            bool ends = endsBlock(opcode);
+            if (opcode == 0x18) { // jr
+                next = u16(next + static_cast<int8_t>(cpu.read8(addr + 1)));
+                ends = !inBlock(block, next);
+            } else if (opcode == 0xC3 || opcode == 0xCD) { // jp, call
+                next = cpu.read16(addr + 1);
+                ends = !inBlock(block, next);
+            }
+            block.ops.push_back({handler, ends ? ANYWHERE : next});
+            if (ends || next > 0xFFFF) {
+                break;
+            }
+            addr = next;
+        }
+        block.firstPageVersion = cpu.bus.pageVersion[block.firstPage];
+        block.lastPageVersion = cpu.bus.pageVersion[block.lastPage];
+        block.bank = cpu.bus.romBank;
+        block.idle = idleLoopAt && idleLoopAt(startPC);
+        block.banked = block.lastPage >= 0x40 && block.firstPage < 0x80;
+        block.checked = block.lastPage >= 0x40;
     }
 
+#ifdef DIFFERENTIAL_TEST
+    // runs the block, then replays the same instructions through the interpreter from the same state and
+    // compares the results. The interpreter result is kept. Io write handlers run twice, so DIV, TIMA and IF
+    // keep the values the timer caught up to during the first run. Page versions are never wound back: a page
+    // the block remapped (the boot rom going, a bank switch) is bumped so no block translated from the old
+    // contents survives the replay mapping it again.
+    void executeChecked(const Block &block, uint64_t deadline) {
+        cpu.syncFlags();
+        vector<u8> memory = cpu.bus.ram;
+        array<u8, 8> registers;
+        copy(begin(cpu.registers), end(cpu.registers), registers.begin());
+        u16 sp = cpu.sp;
+        u16 pc = cpu.pc;
+        uint64_t clock = cpu.clock;
+        bool ime = cpu.irq.ime;
+        bool halted = cpu.halted;
+        bool imePending = cpu.imePending;
+        array<const u8 *, 256> readPages = cpu.bus.locked ? cpu.bus.unlockedReadPages : cpu.bus.readPages;
+        function<void()> restoreDevices = saveDevices ? saveDevices() : nullptr;
+
+        int executed = execute(block, deadline);
+        cpu.syncFlags();
+
+        vector<u8> translatedMemory = cpu.bus.ram;
+        array<u8, 8> translatedRegisters;
+        copy(begin(cpu.registers), end(cpu.registers), translatedRegisters.begin());
+        u16 translatedSP = cpu.sp;
+        u16 translatedPC = cpu.pc;
+        uint64_t translatedClock = cpu.clock;
+
+        for (u16 addr: {0xFF04, 0xFF05, 0xFF0F}) {
+            memory[addr] = translatedMemory[addr];
+        }
+        cpu.bus.ram = memory;
+        copy(registers.begin(), registers.end(), begin(cpu.registers));
+        cpu.sp = sp;
+        cpu.pc = pc;
+        cpu.clock = clock;
+        cpu.irq.setIme(ime);
+        cpu.halted = halted;
+        cpu.imePending = imePending;
+        const array<const u8 *, 256> &remapped = cpu.bus.locked ? cpu.bus.unlockedReadPages : cpu.bus.readPages;
+        for (int page = 0; page < 256; ++page) {
+            if (remapped[page] != readPages[page]) {
+                ++cpu.bus.pageVersion[page];
+            }
+        }
+        if (restoreDevices) {
+            restoreDevices();
+        }
+        for (int i = 0; i < executed; ++i) {
+            cpu.fetchDecodeExecute();
+        }
+        cpu.syncFlags();
+
+        if (translatedMemory != cpu.bus.ram ||
+            !equal(translatedRegisters.begin(), translatedRegisters.end(), begin(cpu.registers)) ||
+            translatedSP != cpu.sp || translatedPC != cpu.pc || translatedClock != cpu.clock) {
+            printf("Translated block at [%x] diverged from the interpreter after %d instructions\n", pc, executed);
+            exit(1);
+        }
+    }
+#endif
 };
 
+
 struct OAMFlags {
     u8 unused: 4;
     u8 palette: 1;
@@ -1159,35 +1561,13 @@ struct OAMEntry {
     OAMFlags flags;
 };
 
-struct PixelColor {
-    uint32_t priority;
-    u16 shade;
-    const u8 *color;
-
-    PixelColor(u8 p, u16 s, const u8 *c) : priority{p}, shade{s}, color{c} {
-
-    }
-};
-
-struct PixelComparator {
-    bool operator()(const PixelColor &p1, const PixelColor &p2) {
-        return p1.priority > p2.priority;
-    }
-};
-
-
 class PPU {
 public:
     constexpr static int PIXEL_COLUMNS = 160;
     constexpr static int PIXEL_ROWS = 144;
 
-    constexpr static int DEVICE_RESOLUTION_X = 3;
-    constexpr static int DEVICE_RESOLUTION_Y = 3;
-
-    constexpr static int DEVICE_WIDTH = PIXEL_COLUMNS * DEVICE_RESOLUTION_X;
-    constexpr static int DEVICE_HEIGHT = PIXEL_ROWS * DEVICE_RESOLUTION_Y;
-
-    vector<sf::Uint8> &pixels;
+    vector<sf::Uint8> &pixels; // PIXEL_COLUMNS x PIXEL_ROWS RGBA, the Scaler blows it up for the window
+    DirtyRows changedLines;    // lines whose pixels differ from what the frontend last uploaded
     vector<u8> &vram; // reserve 8KB
 
     u8 &scx;
@@ -1208,447 +1588,1838 @@ public:
 
     uint64_t clock;
 
-    PPU(const string &bootROM, const string &cartridgeROM, vector<sf::Uint8> &pixels, vector<u8> &ram)
-            : pixels{pixels}, scx{vram[0xFF43]}, scy{vram[0xFF42]}, ly{vram[0xFF44]}, lyc{vram[0xFF45]},
+    PPU(vector<sf::Uint8> &pixels, vector<u8> &ram)
+            : pixels{pixels}, changedLines{PIXEL_ROWS}, scx{vram[0xFF43]}, scy{vram[0xFF42]}, ly{vram[0xFF44]}, lyc{vram[0xFF45]},
               wx{vram[0xFF4B]}, wy{vram[0xFF4A]}, dma{vram[0xFF46]}, bgp{vram[0xFF47]},
               obp0{vram[0xFF48]}, obp1{vram[0xFF49]}, lcdControl{*reinterpret_cast<LCDControl *>(&vram[0xFF40])},
               lcdStatus{*reinterpret_cast<LCDStatus *>(&vram[0xFF41])},
               vram(ram),
               oamEntries{reinterpret_cast<OAMEntry *>(&vram[OAM_ADDR_START])},
-              clock{0} {
+              clock{0}, frameStart{0}, renderedLines{0}, drawing{true}, windowLine{0}, kernels{PixelKernels::get()}, bgLine{},
+              spriteLine{}, spriteMask{}, lineWrites{}, lineWriteCount{0}, spriteY{}, spriteX{}, spriteTile{}, spriteFlags{}, lineSprites{},
+              lineSpriteCount{}, spritesDirty{true}, bucketedHeight{0}, shades{GRAY_SHADES}, paletteRGBA{},
+              decodedRows{}, flippedRows{} {
+        fill(begin(dirtyRows), end(dirtyRows), true);
+#ifdef LAYER_CACHE
+        layers.resize(4 * LAYER_SIZE * LAYER_SIZE);
+        fill(&layerTileDirty[0][0], &layerTileDirty[0][0] + 4 * MAP_TILES, true);
+        fill(begin(layerDirtyCount), end(layerDirtyCount), MAP_TILES);
+        fill(begin(tileDataDirty), end(tileDataDirty), false);
+        dirtyTiles.reserve(TILES);
+        for (int map = 0; map < 2; ++map) {
+            fill(begin(mapEntryHead[map]), end(mapEntryHead[map]), NO_MAP_ENTRY);
+            for (int ix = 0; ix < MAP_TILES; ++ix) {
+                linkMapEntry(map, ix, vram[(map ? 0x9C00 : 0x9800) + ix]);
+            }
+        }
+#endif
+        palettesWritten();
+    }
 
-        debugInitializeCartridgeHeader();
-        std::ifstream input(bootROM, std::ios::binary);
-        std::copy(std::istreambuf_iterator(input), {}, vram.begin());
-        std::ifstream input2(cartridgeROM, std::ios::binary);
-        std::copy(std::istreambuf_iterator(input), {}, vram.begin() + 0x100);
+    constexpr static uint64_t CLOCKS_PER_LINE = 456;
+    constexpr static int LINES_PER_FRAME = 154;
+    constexpr static uint64_t CLOCKS_PER_FRAME = CLOCKS_PER_LINE * LINES_PER_FRAME;
+    constexpr static uint64_t OAM_SEARCH_CLOCKS = 80;
+    constexpr static uint64_t PIXEL_TRANSFER_CLOCKS = 172; // shortest mode 3
+
+    enum Mode : u8 {
+        HBLANK,
+        VBLANK,
+        OAM_SEARCH,
+        PIXEL_TRANSFER
+    };
+
+    // A mode transition: the line and the mode it enters at clock
+    struct ModeEdge {
+        uint64_t clock;
+        int line;
+        Mode mode;
+    };
+
+    // The ppu is lazy: LY and STAT are worked out from the clock when read, and lines are drawn in batches
+    // when something is about to change what they would show, or at VBlank. Mode edges are computed rather
+    // than stepped through, the scheduler only hears about the ones that raise an interrupt.
+    uint64_t frameStart; // clock line 0 of the current frame starts at
+    int renderedLines;   // lines of the current frame drawn so far
+    bool drawing;        // false for skipped frames, lines are still passed but no pixels are worked out
+    int windowLine;      // window row the next line that shows the window draws
+
+    const PixelKernels &kernels;
+    // background and window colour indices of the line being drawn, once sprites are merged in it holds
+    // entries of paletteRGBA: 0-3 through BGP, 4-7 through OBP0, 8-11 through OBP1
+    u8 bgLine[PIXEL_COLUMNS];
+    u8 spriteLine[PIXEL_COLUMNS]; // sprite pixels as paletteRGBA entries, shown where spriteMask is 0xFF
+    u8 spriteMask[PIXEL_COLUMNS];
+
+    // register writes that landed in the middle of the line being drawn, in order
+    struct RegisterWrite {
+        u16 dot; // clocks into mode 3
+        u8 x;    // first pixel that sees the new value
+        u8 addr; // low byte of the register
+        u8 oldValue;
+        u8 newValue;
+    };
+    // fetching the first tiles holds up the first pixel this long into mode 3
+    constexpr static uint64_t PIXEL_OUTPUT_DELAY = 12;
+    // ldh takes 12 clocks and mode 3 at most 289, so this is never reached
+    constexpr static int MAX_LINE_WRITES = 32;
+    RegisterWrite lineWrites[MAX_LINE_WRITES];
+    int lineWriteCount;
+
+    constexpr static int SPRITES = 40;
+    constexpr static int SPRITES_PER_LINE = 10;
+    u8 spriteY[SPRITES];
+    u8 spriteX[SPRITES];
+    u8 spriteTile[SPRITES];
+    OAMFlags spriteFlags[SPRITES];
+    u8 lineSprites[PIXEL_ROWS][SPRITES_PER_LINE]; // OAM indices of each line's sprites in priority order
+    u8 lineSpriteCount[PIXEL_ROWS];
+    bool spritesDirty;
+    int bucketedHeight;
+
+    // the 4 colours the shades 0 (lightest) to 3 come out as
+    using Shades = array<array<u8, 4>, 4>;
+    constexpr static Shades GRAY_SHADES = {{{0xff, 0xff, 0xff, 0xff},
+                                            {0xbb, 0xbb, 0xbb, 0xff},
+                                            {0x88, 0x88, 0x88, 0xff},
+                                            {0x00, 0x00, 0x00, 0xff}}};
+    constexpr static Shades GREEN_SHADES = {{{0x9b, 0xbc, 0x0f, 0xff},
+                                             {0x8b, 0xac, 0x0f, 0xff},
+                                             {0x30, 0x62, 0x30, 0xff},
+                                             {0x0f, 0x38, 0x0f, 0xff}}};
+    Shades shades;
+    // BGP, OBP0 and OBP1 resolved to RGBA, rebuilt when one of them or the shades change
+    uint32_t paletteRGBA[12];
+
+    // Every tile row decoded to colour indices, and mirrored for x-flipped sprites. Tile data is read far more
+    // often than it's written, so rows are only decoded again after a write to their two bytes marks them dirty.
+    constexpr static u16 TILE_DATA_START = 0x8000;
+    constexpr static u16 TILE_DATA_END = 0x9800;
+    constexpr static int TILES = (TILE_DATA_END - TILE_DATA_START) / 16;
+    u8 decodedRows[TILES * 8][8];
+    u8 flippedRows[TILES * 8][8];
+    bool dirtyRows[TILES * 8];
+
+#ifdef LAYER_CACHE
+    // Both tile maps laid out as 256x256 colour indices, once for each tile data addressing mode (LCDC bit 4),
+    // so a background or window line is a copy out of a row. Layer 2 * dataSelect + mapSelect. A tile is
+    // built again after a write to its map entry, or to the tile data the entry points at
+    constexpr static int LAYER_SIZE = 256;
+    constexpr static int MAP_TILES = 32 * 32;
+    vector<u8> layers;
+    bool layerTileDirty[4][MAP_TILES];
+    int layerDirtyCount[4];  // tiles of the layer marked in layerTileDirty
+    bool tileDataDirty[TILES];
+    vector<u16> dirtyTiles;  // the tiles set in tileDataDirty, written since the layers last looked
+    // every map entry is in a doubly linked list of the entries holding the same tile byte, so a tile data write
+    // only visits the entries showing that tile. mapEntryTile is the byte an entry is listed under
+    constexpr static u16 NO_MAP_ENTRY = MAP_TILES;
+    u16 mapEntryHead[2][256];
+    u16 mapEntryNext[2][MAP_TILES];
+    u16 mapEntryPrev[2][MAP_TILES];
+    u8 mapEntryTile[2][MAP_TILES];
+#endif
+
+    [[nodiscard]] uint64_t lineStart(int line) const {
+        return frameStart + line * CLOCKS_PER_LINE;
     }
 
+    void startFrame(uint64_t clock) {
+        frameStart = clock;
+        renderedLines = 0;
+        windowLine = 0;
+        lineWriteCount = 0;
+    }
+
+    // draws every line of the frame whose pixel transfer is over by clock. The line still in mode 3 waits, so
+    // register writes that land in the middle of it can be logged and split it
+    template<typename BeforeLine, typename DrawLine>
+    void catchUp(uint64_t clock, BeforeLine beforeLine, DrawLine drawLine) {
+        while (renderedLines < PIXEL_ROWS &&
+               lineStart(renderedLines) + OAM_SEARCH_CLOCKS + pixelTransferClocks(renderedLines) <= clock) {
+            beforeLine(lineStart(renderedLines) + OAM_SEARCH_CLOCKS);
+            if (drawing) {
+                drawLine(renderedLines);
+            }
+            ++renderedLines;
+        }
+        this->clock = max(this->clock, clock);
+    }
+
+    // mode 3 grows with the fine scroll, the window and every sprite on the line. The sprites come from the
+    // line's bucket, so the mode timing functions below aren't const: they may have to rebucket after OAM changed
+    [[nodiscard]] uint64_t pixelTransferClocks(int line) {
+        uint64_t clocks = PIXEL_TRANSFER_CLOCKS + (scx & 7);
+        if (lcdControl.windowDispEnabled && line >= wy && wx < 167) {
+            clocks += 6;
+        }
+        if (lcdControl.objSpriteDisplayEnable) {
+            bucketSprites();
+            for (int i = 0; i < lineSpriteCount[line]; ++i) {
+                clocks += 11 - min(5, (spriteX[lineSprites[line][i]] + scx) % 8);
+            }
+        }
+        return clocks;
+    }
+
+    // the edge at or before clock, i.e. the mode the ppu is in
+    [[nodiscard]] ModeEdge modeAt(uint64_t clock) {
+        uint64_t sinceFrame = (clock - min(clock, frameStart)) % CLOCKS_PER_FRAME;
+        uint64_t start = clock - (clock < frameStart ? 0 : sinceFrame % CLOCKS_PER_LINE);
+        int line = sinceFrame / CLOCKS_PER_LINE;
+        uint64_t sinceLine = clock - start;
+        if (line >= PIXEL_ROWS) {
+            return {start, line, VBLANK};
+        } else if (sinceLine < OAM_SEARCH_CLOCKS) {
+            return {start, line, OAM_SEARCH};
+        }
+        uint64_t hblank = start + OAM_SEARCH_CLOCKS + pixelTransferClocks(line);
+        if (clock < hblank) {
+            return {start + OAM_SEARCH_CLOCKS, line, PIXEL_TRANSFER};
+        }
+        return {hblank, line, HBLANK};
+    }
+
+    [[nodiscard]] ModeEdge nextEdge(const ModeEdge &edge) {
+        uint64_t lineStart = edge.mode == PIXEL_TRANSFER ? edge.clock - OAM_SEARCH_CLOCKS :
+                             edge.mode == HBLANK ? edge.clock - OAM_SEARCH_CLOCKS - pixelTransferClocks(edge.line) :
+                             edge.clock;
+        switch (edge.mode) {
+            case OAM_SEARCH:
+                return {edge.clock + OAM_SEARCH_CLOCKS, edge.line, PIXEL_TRANSFER};
+            case PIXEL_TRANSFER:
+                return {edge.clock + pixelTransferClocks(edge.line), edge.line, HBLANK};
+            default: {
+                int line = (edge.line + 1) % LINES_PER_FRAME;
+                return {lineStart + CLOCKS_PER_LINE, line, line < PIXEL_ROWS ? OAM_SEARCH : VBLANK};
+            }
+        }
+    }
+
+    // brings LY and the STAT mode and coincidence bits up to clock
+    void syncRegisters(uint64_t clock) {
+        if (!lcdControl.lcdEnabled) {
+            ly = 0;
+            lcdStatus.modeFlag = HBLANK;
+        } else {
+            ModeEdge edge = modeAt(clock);
+            ly = edge.line;
+            lcdStatus.modeFlag = edge.mode;
+        }
+        lcdStatus.coincidenceFlag = ly == lyc;
+    }
+
+    // first clock after `after` at which LY or STAT read differently
+    [[nodiscard]] uint64_t nextRegisterChange(uint64_t after) {
+        if (!lcdControl.lcdEnabled) {
+            return UINT64_MAX;
+        }
+        return nextEdge(modeAt(after)).clock;
+    }
+
+    // the STAT interrupt fires when the OR of its enabled sources goes from low to high
+    [[nodiscard]] bool statLine(int line, Mode mode) const {
+        return (lcdStatus.coincidenceInterrupt && line == lyc) ||
+               (lcdStatus.hblankInterrupt && mode == HBLANK) ||
+               (lcdStatus.vblankInterrupt && mode == VBLANK) ||
+               (lcdStatus.oamInterrupt && mode == OAM_SEARCH);
+    }
+
+    // the STAT interrupt line at clock, low with the lcd off
+    [[nodiscard]] bool statLineAt(uint64_t clock) {
+        if (!lcdControl.lcdEnabled) {
+            return false;
+        }
+        ModeEdge edge = modeAt(clock);
+        return statLine(edge.line, edge.mode);
+    }
+
+    // first mode edge after `after` at which the STAT interrupt line rises
+    [[nodiscard]] uint64_t nextStatInterrupt(uint64_t after) {
+        if (!lcdControl.lcdEnabled || !(lcdStatus.coincidenceInterrupt || lcdStatus.hblankInterrupt ||
+                                        lcdStatus.vblankInterrupt || lcdStatus.oamInterrupt)) {
+            return UINT64_MAX;
+        }
+        ModeEdge edge = modeAt(after);
+        bool high = statLine(edge.line, edge.mode);
+        // a frame and a bit covers every source
+        for (int i = 0; i < 4 * LINES_PER_FRAME; ++i) {
+            edge = nextEdge(edge);
+            bool wasHigh = high;
+            high = statLine(edge.line, edge.mode);
+            if (high && !wasHigh) {
+                return edge.clock;
+            }
+        }
+        return UINT64_MAX;
+    }
+
+    // the registers the line renderer reads
+    static bool affectsPixels(u16 addr) {
+        return addr == 0xFF40 || addr == 0xFF42 || addr == 0xFF43 || (addr >= 0xFF47 && addr <= 0xFF4B);
+    }
+
+    // called before a register write lands. One in the middle of the line in mode 3 is logged with the dot
+    // and pixel it reaches, the line is then drawn in segments: old values left of it, new ones from it on
+    void logRegisterWrite(uint64_t clock, u16 addr, u8 value) {
+        if (!drawing || !lcdControl.lcdEnabled || !affectsPixels(addr) || renderedLines >= PIXEL_ROWS) {
+            return;
+        }
+        ModeEdge edge = modeAt(clock);
+        if (edge.mode != PIXEL_TRANSFER || edge.line != renderedLines || lineWriteCount == MAX_LINE_WRITES) {
+            return;
+        }
+        u16 dot = clock - edge.clock;
+        u8 x = clamp<int>(int(dot) - int(PIXEL_OUTPUT_DELAY), 0, PIXEL_COLUMNS);
+        lineWrites[lineWriteCount++] = {dot, x, u8(addr), vram[addr], value};
+    }
+
+    // puts the logged registers back to how they were when the line started
+    void rewindLineWrites() {
+        for (int i = lineWriteCount - 1; i >= 0; --i) {
+            vram[0xFF00 | lineWrites[i].addr] = lineWrites[i].oldValue;
+        }
+    }
+
+    // one line at a time into colour index buffers: each tile row is fetched once and decoded 8 pixels at a
+    // time, sprites are merged over the background, and only the finished line is turned into RGBA. Without
+    // logged writes the line is a single segment
     void pixelTransfer(int y) {
+        if (!lcdControl.lcdEnabled) {
+            lineWriteCount = 0;
+            return;
+        }
 
-        // screen dimensions: 166 x 143 (166 wide and 143 long)
+        bool windowShown = false;
+        forEachSegment([&](int from, int to) {
+            // with bit 0 of LCDC clear the background and window are blank, sprites still show
+            if (lcdControl.bgDisplayEnabled) {
+                renderBackground(y, from, to);
+                windowShown |= renderWindow(y, from, to);
+            } else {
+                fill(bgLine + from, bgLine + to, 0);
+            }
+        });
+        if (windowShown) {
+            ++windowLine;
+        }
+
+        bool sprites = (lcdControl.objSpriteDisplayEnable || lineWriteCount > 0) && renderSprites(y);
+        forEachSegment([&](int from, int to) {
+            if (sprites && lcdControl.objSpriteDisplayEnable) {
+                kernels.mergeLayers(bgLine + from, spriteLine + from, spriteMask + from, to - from);
+            }
+            if (lineWriteCount > 0) {
+                palettesWritten();
+            }
+            drawLineToScreen(y, from, to);
+        });
+        lineWriteCount = 0;
+    }
+
+    // calls draw for each run of pixels with the registers as they were while it was output, and leaves them
+    // at their latest values
+    template<typename Draw>
+    void forEachSegment(Draw draw) {
+        if (lineWriteCount == 0) {
+            draw(0, PIXEL_COLUMNS);
+            return;
+        }
+        rewindLineWrites();
+        int from = 0;
+        for (int i = 0; i < lineWriteCount; ++i) {
+            const RegisterWrite &w = lineWrites[i];
+            if (w.x > from) {
+                draw(from, w.x);
+                from = w.x;
+            }
+            vram[0xFF00 | w.addr] = w.newValue;
+        }
+        if (from < PIXEL_COLUMNS) {
+            draw(from, PIXEL_COLUMNS);
+        }
+    }
+
+    void tileDataWritten(u16 addr) {
+        dirtyRows[(addr - TILE_DATA_START) >> 1] = true;
+#ifdef LAYER_CACHE
+        u16 tile = (addr - TILE_DATA_START) >> 4;
+        if (!tileDataDirty[tile]) {
+            tileDataDirty[tile] = true;
+            dirtyTiles.push_back(tile);
+        }
+#endif
+    }
+
+#ifdef LAYER_CACHE
+    void tileMapWritten(u16 addr) {
+        int map = addr >= 0x9C00;
+        int ix = addr & (MAP_TILES - 1);
+        if (mapEntryTile[map][ix] != vram[addr]) {
+            unlinkMapEntry(map, ix);
+            linkMapEntry(map, ix, vram[addr]);
+        }
+        markLayerTile(map, ix);
+        markLayerTile(2 + map, ix);
+    }
 
-        // at ly flush to display and generate interrupt?
-        // lyc is a counter that gets incremented. when ly == lyc then an interrupt is generated
+    void linkMapEntry(int map, int ix, u8 tile) {
+        mapEntryTile[map][ix] = tile;
+        mapEntryPrev[map][ix] = NO_MAP_ENTRY;
+        mapEntryNext[map][ix] = mapEntryHead[map][tile];
+        if (mapEntryHead[map][tile] != NO_MAP_ENTRY) {
+            mapEntryPrev[map][mapEntryHead[map][tile]] = ix;
+        }
+        mapEntryHead[map][tile] = ix;
+    }
+
+    void unlinkMapEntry(int map, int ix) {
+        u16 prev = mapEntryPrev[map][ix];
+        u16 next = mapEntryNext[map][ix];
+        if (prev == NO_MAP_ENTRY) {
+            mapEntryHead[map][mapEntryTile[map][ix]] = next;
+        } else {
+            mapEntryNext[map][prev] = next;
+        }
+        if (next != NO_MAP_ENTRY) {
+            mapEntryPrev[map][next] = prev;
+        }
+    }
+
+    void markLayerTile(int layer, int ix) {
+        if (!layerTileDirty[layer][ix]) {
+            layerTileDirty[layer][ix] = true;
+            ++layerDirtyCount[layer];
+        }
+    }
+
+    // which of the 384 tiles the map entry points at in the layer's addressing mode
+    int layerTileIndex(int layer, int ix) const {
+        u8 tile = vram[(layer & 1 ? 0x9C00 : 0x9800) + ix];
+        return layer & 2 ? tile : 256 + static_cast<int8_t>(tile);
+    }
+
+    // tile data writes are only matched up with the map entries using them when a layer is next read, a game
+    // loading tiles doesn't pay for it on every write. Layers 2 and 3 reach tiles 0-255 through the map byte,
+    // layers 0 and 1 tiles 128-383, which is the byte as signed plus 256. Either way the byte is the low 8 bits
+    void staleTilesFromData() {
+        for (u16 tile: dirtyTiles) {
+            tileDataDirty[tile] = false;
+            for (int map = 0; map < 2; ++map) {
+                for (u16 ix = mapEntryHead[map][tile & 0xFF]; ix != NO_MAP_ENTRY; ix = mapEntryNext[map][ix]) {
+                    if (tile < 256) {
+                        markLayerTile(2 + map, ix);
+                    }
+                    if (tile >= 128) {
+                        markLayerTile(map, ix);
+                    }
+                }
+            }
+        }
+        dirtyTiles.clear();
+    }
+
+    void buildLayerTile(int layer, int ix) {
+        u16 rowStart = TILE_DATA_START + layerTileIndex(layer, ix) * 16;
+        u8 *out = &layers[(layer * LAYER_SIZE + (ix >> 5) * 8) * LAYER_SIZE + (ix & 31) * 8];
+        for (int row = 0; row < 8; ++row) {
+            memcpy(out + row * LAYER_SIZE, decodedRow(rowStart + 2 * row), 8);
+        }
+        layerTileDirty[layer][ix] = false;
+        --layerDirtyCount[layer];
+    }
+
+    // row mapY of the layer the current LCDC picks with mapSelect, the tiles under columns [x, x + n) are
+    // brought up to date first
+    const u8 *layerRow(bool mapSelect, int mapY, int x, int n) {
+        int layer = (lcdControl.bgWindowTileDataSelect ? 2 : 0) + mapSelect;
+        if (!dirtyTiles.empty()) {
+            staleTilesFromData();
+        }
+        if (layerDirtyCount[layer] > 0) {
+            for (int tileX = x >> 3; tileX <= (x + n - 1) >> 3; ++tileX) {
+                int ix = (mapY >> 3) * 32 + (tileX & 31);
+                if (layerTileDirty[layer][ix]) {
+                    buildLayerTile(layer, ix);
+                }
+            }
+        }
+        return &layers[(layer * LAYER_SIZE + mapY) * LAYER_SIZE];
+    }
+#endif
+
+    // the 8 colour indices of the tile row starting at rowStart
+    const u8 *decodedRow(u16 rowStart, bool xFlip = false) {
+        int row = (rowStart - TILE_DATA_START) >> 1;
+        if (dirtyRows[row]) {
+            // 2bpp: the first byte holds the low bit of each pixel, the second the high bit
+            kernels.decodeRow(vram[rowStart], vram[rowStart + 1], decodedRows[row]);
+            reverse_copy(begin(decodedRows[row]), end(decodedRows[row]), flippedRows[row]);
+            dirtyRows[row] = false;
+        }
+        return xFlip ? flippedRows[row] : decodedRows[row];
+    }
+
+    void renderBackground(int y, int from, int to) {
+        int mapY = (y + scy) & 0xFF;
+        int mapX = (from + scx) & 0xFF;
+#ifdef LAYER_CACHE
+        // the map wraps at 256 pixels, so at most two copies
+        int n = to - from;
+        const u8 *row = layerRow(lcdControl.bgTileMapDisplaySelect, mapY, mapX, n);
+        int first = min(n, LAYER_SIZE - mapX);
+        memcpy(bgLine + from, row + mapX, first);
+        memcpy(bgLine + from + first, row, n - first);
+#else
+        int tileX = mapX >> 3;
+        int skip = mapX & 7;
+        for (int x = from; x < to; ++tileX) {
+            const u8 *indices = decodedRow(getBackgroundTileRowStart((mapY >> 3) * 32 + (tileX & 31), mapY & 7));
+            for (int i = skip; i < 8 && x < to; ++i) {
+                bgLine[x++] = indices[i];
+            }
+            skip = 0;
+        }
+#endif
+    }
+
+    // the window has its own line counter, it only moves on lines the window was drawn on
+    bool renderWindow(int y, int from, int to) {
+        if (!lcdControl.windowDispEnabled || y < wy || wx > 166) {
+            return false;
+        }
+        int left = wx - 7;
+        int x = max(from, left);
+        if (x >= to) {
+            return false;
+        }
+        int column = x - left;
+#ifdef LAYER_CACHE
+        // x starts at 0 and the window is at most 167 wide, it never wraps
+        memcpy(bgLine + x, layerRow(lcdControl.windowTileMapDisplaySelect, windowLine, column, to - x) + column,
+               to - x);
+#else
+        int skip = column & 7;
+        for (int tileX = column >> 3; x < to; ++tileX) {
+            const u8 *indices = decodedRow(getWindowTileRowStart((windowLine >> 3) * 32 + tileX, windowLine & 7));
+            for (int i = skip; i < 8 && x < to; ++i) {
+                bgLine[x++] = indices[i];
+            }
+            skip = 0;
+        }
+#endif
+        return true;
+    }
+
+    void oamWritten() {
+        spritesDirty = true;
+    }
+
+    // OAM search for the whole frame at once. OAM is copied out into one array per field and every sprite is
+    // put in the buckets of the lines it covers, up to the hardware's 10 per line in OAM order. Each bucket is
+    // then ordered by DMG priority: the smaller x wins, then the lower OAM index. Redone only after OAM or the
+    // sprite height changes
+    void bucketSprites() {
+        int height = lcdControl.objSpriteSize ? 16 : 8;
+        if (!spritesDirty && height == bucketedHeight) {
+            return;
+        }
+        for (int i = 0; i < SPRITES; ++i) {
+            spriteY[i] = oamEntries[i].yPos;
+            spriteX[i] = oamEntries[i].xPos;
+            spriteTile[i] = oamEntries[i].tileNumber;
+            spriteFlags[i] = oamEntries[i].flags;
+        }
+        fill(begin(lineSpriteCount), end(lineSpriteCount), 0);
+        for (int i = 0; i < SPRITES; ++i) {
+            int top = spriteY[i] - 16;
+            for (int line = max(top, 0); line < min(top + height, PIXEL_ROWS); ++line) {
+                if (lineSpriteCount[line] < SPRITES_PER_LINE) {
+                    lineSprites[line][lineSpriteCount[line]++] = i;
+                }
+            }
+        }
+        // buckets hold at most 10 and are filled in index order, an insertion sort on x keeps ties in that order
+        for (int line = 0; line < PIXEL_ROWS; ++line) {
+            u8 *bucket = lineSprites[line];
+            for (int j = 1; j < lineSpriteCount[line]; ++j) {
+                u8 sprite = bucket[j];
+                int k = j;
+                for (; k > 0 && spriteX[bucket[k - 1]] > spriteX[sprite]; --k) {
+                    bucket[k] = bucket[k - 1];
+                }
+                bucket[k] = sprite;
+            }
+        }
+        bucketedHeight = height;
+        spritesDirty = false;
+    }
+
+    // A pixel taken by a sprite stays taken even when that sprite is behind the background.
+    // Fills spriteLine and spriteMask, false if no sprite is on the line
+    bool renderSprites(int y) {
+        bucketSprites();
+        int count = lineSpriteCount[y];
+        if (count == 0) {
+            return false;
+        }
+        int height = bucketedHeight;
+        fill(begin(spriteMask), end(spriteMask), 0);
+
+        array<bool, PIXEL_COLUMNS> taken{};
+        for (int s = 0; s < count; ++s) {
+            int sprite = lineSprites[y][s];
+            OAMFlags flags = spriteFlags[sprite];
+            int row = y + 16 - spriteY[sprite];
+            if (flags.yFlip) {
+                row = height - 1 - row;
+            }
+            u8 tile = height == 16 ? (spriteTile[sprite] & 0xFE) : spriteTile[sprite];
+            const u8 *indices = decodedRow(getTileRowStart(tile, row, 0x8000), flags.xFlip);
+            u8 palette = flags.palette ? 8 : 4;
+            for (int i = 0; i < 8; ++i) {
+                int x = spriteX[sprite] - 8 + i;
+                u8 index = indices[i];
+                if (x < 0 || x >= PIXEL_COLUMNS || index == 0 || taken[x]) {
+                    continue;
+                }
+                taken[x] = true;
+                if (!flags.objToBGPrio || bgLine[x] == 0) {
+                    spriteLine[x] = palette + index;
+                    spriteMask[x] = 0xFF;
+                }
+            }
+        }
+        return true;
+    }
+
+    // one store per pixel at native resolution, scaling is left to presentation. The line is only marked changed
+    // if a pixel differs, most lines of most frames come out the same as last time
+    void drawLineToScreen(int y, int from, int to) {
+        auto *row = reinterpret_cast<uint32_t *>(&pixels[4 * y * PIXEL_COLUMNS]);
+        uint32_t changed = 0;
+        for (int x = from; x < to; ++x) {
+            uint32_t rgba = paletteRGBA[bgLine[x]];
+            changed |= row[x] ^ rgba;
+            row[x] = rgba;
+        }
+        if (changed) {
+            changedLines.mark(y);
+        }
+    }
+
+    // for some regs, 00 is transparent: sprites never reach the table with colour 0
+    void palettesWritten() {
+        u8 registers[3] = {bgp, obp0, obp1};
+        for (int p = 0; p < 3; ++p) {
+            for (int index = 0; index < 4; ++index) {
+                memcpy(&paletteRGBA[4 * p + index], shades[(registers[p] >> (2 * index)) & 3].data(), 4);
+            }
+        }
+    }
+
+    void setShades(const Shades &newShades) {
+        shades = newShades;
+        palettesWritten();
+    }
+
+    constexpr static u16 OAM_ADDR_START = 0xFE00;
+
+
+    static u16 getTileRowStart(int tile, int row, u16 addrStart) {
+        int rowStride = 2;
+        return addrStart + tile * (rowStride * 8) + row * rowStride;
+    }
+
+    u16 getBackgroundTileRowStart(int ix, int row) {
+        assert(lcdControl.bgDisplayEnabled);
+        if (lcdControl.bgWindowTileDataSelect) {
+            u8 tile = lcdControl.bgTileMapDisplaySelect ? vram[0x9C00 + ix] : vram[0x9800 + ix];
+            return getTileRowStart(tile, row, 0x8000);
+        } else {
+            auto tile = static_cast<int8_t>(lcdControl.bgTileMapDisplaySelect ? vram[0x9C00 + ix] : vram[0x9800 + ix]);
+            return getTileRowStart(tile, row, 0x9000);
+        }
+    }
+
+    u16 getWindowTileRowStart(int ix, int row) {
+        assert(lcdControl.windowDispEnabled);
+        if (lcdControl.bgWindowTileDataSelect) {
+            u8 tile = lcdControl.windowTileMapDisplaySelect ? vram[0x9C00 + ix] : vram[0x9800 + ix];
+            return getTileRowStart(tile, row, 0x8000);
+        } else {
+            auto tile = static_cast<int8_t>(lcdControl.windowTileMapDisplaySelect ? vram[0x9C00 + ix] : vram[0x9800 +
+                                                                                                             ix]);
+            return getTileRowStart(tile, row, 0x9000);
+        }
+    }
+
+    [[nodiscard]] bool isPixelTransfer() const noexcept {
+        return lcdStatus.modeFlag == 3;
+    }
+
+    [[nodiscard]] bool isHblank() const noexcept {
+        return lcdStatus.modeFlag == 0;
+    }
+
+    [[nodiscard]] bool isVblank() const noexcept {
+        return lcdStatus.modeFlag == 1;
+    }
+
+    bool vramAccessLegal() const {
+        return !isPixelTransfer();
+    }
 
-        if (lcdControl.lcdEnabled) {
+    bool oamAccessLegal() const {
+        return isHblank() || isVblank();
+    }
+};
 
-            //            draw all 0s to screen;
-            // todo sprite map as well.
 
-            vector<uint8_t> visibleSprites{20, 0};
+// The fast path: whole lines, or the segments between logged register writes.
+class ScanlineRenderer {
+public:
+    PPU &ppu;
 
-            for (int i = 0; i < 40; ++i) {
-                OAMEntry &e = oamEntries[i];
-                if (e.xPos != 0 && e.xPos < 168 && e.yPos <= y + 8 && e.yPos >= y + 8) {
-                    visibleSprites.push_back(i);
-                }
-            }
-            visibleSprites.resize(10);
-            vector<PixelColor> v;
-            v.reserve(12);
-            for (int x = 0; x < PIXEL_COLUMNS; ++x) {
-                v.clear();
+    explicit ScanlineRenderer(PPU &ppu) : ppu{ppu} {
+    }
 
-                if (lcdControl.bgDisplayEnabled) {
+    void drawLine(int y) {
+        ppu.pixelTransfer(y);
+    }
+};
 
-                    int pixelY = ((y + scy) % 256);
-                    int pixelX = (x + scx) % 256;
-                    int tile = (pixelY / 8 * 32 + pixelX / 8);
+// Dot by dot like the hardware: a fetcher reads the tile number, then the low and high bitplanes, 2 dots
+// each, and pushes 8 pixels into the background FIFO once it has run dry. When the output reaches a sprite
+// the fetcher stalls while the sprite is fetched into its own FIFO, mixed into the slots still transparent.
+// A pixel leaves each dot the background FIFO has one. Registers are read when the hardware reads them, so
+// logged mid-line writes land on the dot they were made at. Mode timing still comes from the ppu's model.
+class PixelFifoRenderer {
+public:
+    constexpr static int FETCH_STEP_DOTS = 2;
+    constexpr static int SPRITE_FETCH_DOTS = 6;
 
-                    u16 color = getBackgroundTileMapDataRow(tile, pixelY % 8);
-                    u8 colorShade;
-                    const u8 *col = getPixelColor(pixelX, color, bgp, colorShade);
-                    v.emplace_back(3 * colorShade + 1, colorShade, col);
-                }
+    struct SpritePixel {
+        u8 index;
+        u8 palette; // first paletteRGBA entry of OBP0 or OBP1
+        bool behindBackground;
+    };
 
-                if (lcdControl.windowDispEnabled) {
+    enum FetchStep {
+        GET_TILE,
+        GET_DATA_LOW,
+        GET_DATA_HIGH,
+        PUSH
+    };
 
-                    // wy;
-                    // wx;
-                    // wx = 7, wy = 0 is upper left
+    PPU &ppu;
 
-                    if (x >= wx && y >= wy) {
+    explicit PixelFifoRenderer(PPU &ppu) : ppu{ppu}, bgFifo{}, bgHead{0}, bgSize{0}, spriteFifo{},
+                                           spriteSize{0}, step{GET_TILE}, stepDots{0}, tileX{0}, rowStart{0},
+                                           windowMode{false} {
+    }
 
-                        int pixelY = y - wy;
-                        int pixelX = x - wx + 7;
-                        int tile = (pixelY / 8 * 32 + pixelX / 8);
+    void drawLine(int y) {
+        if (!ppu.lcdControl.lcdEnabled) {
+            ppu.lineWriteCount = 0;
+            return;
+        }
+        ppu.rewindLineWrites();
+        if (ppu.lcdControl.objSpriteDisplayEnable || ppu.lineWriteCount > 0) {
+            ppu.bucketSprites();
+        }
 
-                        u16 color = getWindowTileMapDataRow(tile, pixelY % 8);
-                        u8 colorShade;
-                        auto col = getPixelColor(pixelX, color, bgp, colorShade);
-                        v.emplace_back(10 * colorShade + 2, colorShade, col);
+        bgHead = bgSize = spriteSize = 0;
+        step = GET_TILE;
+        stepDots = 0;
+        tileX = 0;
+        windowMode = false;
+        int discard = ppu.scx & 7;
+        bool windowShown = false;
+        array<bool, PPU::SPRITES_PER_LINE> spriteFetched{};
+        int spriteCount = ppu.lineSpriteCount[y];
+
+        int x = 0;
+        int flushed = 0;
+        int write = 0;
+        for (int dot = 0; x < PPU::PIXEL_COLUMNS; ++dot) {
+            for (; write < ppu.lineWriteCount && ppu.lineWrites[write].dot <= dot; ++write) {
+                applyWrite(ppu.lineWrites[write], y, flushed, x);
+            }
+
+            // the window takes over from the pixel it starts at, the fetcher starts again on its first tile
+            if (!windowMode && ppu.lcdControl.windowDispEnabled && ppu.lcdControl.bgDisplayEnabled &&
+                y >= ppu.wy && ppu.wx <= 166 && x >= ppu.wx - 7) {
+                windowMode = windowShown = true;
+                bgHead = bgSize = 0;
+                step = GET_TILE;
+                stepDots = 0;
+                tileX = 0;
+                discard = max(0, 7 - ppu.wx);
+            }
+
+            if (discard == 0 && ppu.lcdControl.objSpriteDisplayEnable) {
+                for (int s = 0; s < spriteCount; ++s) {
+                    if (!spriteFetched[s] && ppu.spriteX[ppu.lineSprites[y][s]] - 8 <= x) {
+                        spriteFetched[s] = true;
+                        fetchSprite(ppu.lineSprites[y][s], y, x);
+                        dot += SPRITE_FETCH_DOTS;
                     }
                 }
+            }
 
+            runFetcher(y);
 
-                for (auto s: visibleSprites) {
-                    OAMEntry &e = oamEntries[s];
-                    if (e.xPos <= x + 8 && x + 8 <= e.xPos) {
-                        u8 row = !e.flags.yFlip ? y - e.yPos : 8 - (y - e.yPos);
-                        u16 color = getTileData(e.tileNumber, row, 0x8000);
-                        u8 colorShade;
-                        u8 &palette = e.flags.palette == 0 ? obp0 : obp1;
-                        u8 column = !e.flags.xFlip ? x - e.xPos : 8 - (x - e.xPos);
-                        auto col = getPixelColor(column, color, palette, colorShade);
-                        uint32_t priority;
-                        if (colorShade == 0) {
-                            priority = 0;
-                        } else if (e.flags.objToBGPrio == 1) {
-                            priority = 3;
-                        } else {
-                            priority = (((255 - x) << 8) | (255 - e.tileNumber));
-                        }
-                        v.emplace_back(priority, colorShade, col);
-                    }
+            if (bgSize > 0) {
+                u8 bg = popBackground();
+                if (discard > 0) {
+                    --discard;
+                    continue;
                 }
-
-                if (!v.empty()) {
-                    auto visible = *min_element(v.begin(), v.end(), PixelComparator());
-                    drawColorToScreen(x, y, visible.color);
+                u8 code = bg;
+                if (spriteSize > 0) {
+                    SpritePixel sprite = spriteFifo[0];
+                    copy(spriteFifo + 1, spriteFifo + spriteSize, spriteFifo);
+                    --spriteSize;
+                    if (sprite.index != 0 && ppu.lcdControl.objSpriteDisplayEnable &&
+                        (!sprite.behindBackground || bg == 0)) {
+                        code = sprite.palette + sprite.index;
+                    }
                 }
-
+                ppu.bgLine[x++] = code;
             }
         }
-        clock += 172;
+        for (; write < ppu.lineWriteCount; ++write) {
+            applyWrite(ppu.lineWrites[write], y, flushed, x);
+        }
+        ppu.drawLineToScreen(y, flushed, PPU::PIXEL_COLUMNS);
+        if (windowShown) {
+            ++ppu.windowLine;
+        }
+        ppu.lineWriteCount = 0;
+    }
 
+private:
+    u8 bgFifo[16];
+    int bgHead;
+    int bgSize;
+    SpritePixel spriteFifo[8];
+    int spriteSize;
+    FetchStep step;
+    int stepDots;
+    int tileX;
+    u16 rowStart;
+    bool windowMode;
+
+    // pixels already out were coloured with the palettes as they were, so they go to the screen first
+    void applyWrite(const PPU::RegisterWrite &w, int y, int &flushed, int x) {
+        if (w.addr >= 0x47 && w.addr <= 0x49) {
+            ppu.drawLineToScreen(y, flushed, x);
+            flushed = x;
+            ppu.vram[0xFF00 | w.addr] = w.newValue;
+            ppu.palettesWritten();
+        } else {
+            ppu.vram[0xFF00 | w.addr] = w.newValue;
+        }
     }
 
-    const u8 *getPixelColor(int pixelX, u16 color, u8 &reg, u8 &colorShade) const {
-        const u8 *topColor;
-        int xoffs = pixelX & 7;
-        u8 upper = ((color >> 8) >> (7 - xoffs)) & 1;
-        u8 lower = (color >> (7 - xoffs)) & 1;
-        colorShade = upper * 2 + lower;
-        const u8 *outputColor = colorisePixel(reg, colorShade);
-        topColor = outputColor;
-        return topColor;
+    void runFetcher(int y) {
+        if (step != PUSH && ++stepDots < FETCH_STEP_DOTS) {
+            return;
+        }
+        stepDots = 0;
+        switch (step) {
+            case GET_TILE:
+                if (windowMode) {
+                    rowStart = ppu.getWindowTileRowStart((ppu.windowLine >> 3) * 32 + tileX, ppu.windowLine & 7);
+                } else if (ppu.lcdControl.bgDisplayEnabled) {
+                    int mapY = (y + ppu.scy) & 0xFF;
+                    int mapX = ((ppu.scx >> 3) + tileX) & 31;
+                    rowStart = ppu.getBackgroundTileRowStart((mapY >> 3) * 32 + mapX, mapY & 7);
+                }
+                step = GET_DATA_LOW;
+                break;
+            case GET_DATA_LOW:
+                step = GET_DATA_HIGH;
+                break;
+            case GET_DATA_HIGH:
+                step = PUSH;
+                break;
+            case PUSH:
+                // the background FIFO only takes a tile once it's empty
+                if (bgSize == 0) {
+                    if (windowMode || ppu.lcdControl.bgDisplayEnabled) {
+                        const u8 *indices = ppu.decodedRow(rowStart);
+                        copy(indices, indices + 8, bgFifo);
+                    } else {
+                        fill(bgFifo, bgFifo + 8, 0);
+                    }
+                    bgHead = 0;
+                    bgSize = 8;
+                    ++tileX;
+                    step = GET_TILE;
+                }
+                break;
+        }
     }
 
-    void drawColorToScreen(int pixelX, int pixelY, const u8 *col) {
+    u8 popBackground() {
+        --bgSize;
+        return bgFifo[bgHead++];
+    }
 
-        int deviceX = pixelX * DEVICE_RESOLUTION_X;
-        int deviceY = pixelY * DEVICE_RESOLUTION_Y;
-        int pixelStartIx = deviceY * DEVICE_WIDTH + deviceX;
-        for (int dy = 0; dy < DEVICE_RESOLUTION_Y; ++dy) {
-            for (int dx = 0; dx < DEVICE_RESOLUTION_X; ++dx) {
-                int pixelIx = 4 * (pixelStartIx + dy * DEVICE_WIDTH + dx);
-                pixels[pixelIx] = *col;
-                pixels[pixelIx + 1] = *(col + 1);
-                pixels[pixelIx + 2] = *(col + 2);
-                pixels[pixelIx + 3] = *(col + 3);
+    // a sprite partly off the left edge is fetched at pixel 0 without the pixels that are off screen
+    void fetchSprite(int sprite, int y, int x) {
+        int height = ppu.bucketedHeight;
+        OAMFlags flags = ppu.spriteFlags[sprite];
+        int row = y + 16 - ppu.spriteY[sprite];
+        if (flags.yFlip) {
+            row = height - 1 - row;
+        }
+        u8 tile = height == 16 ? (ppu.spriteTile[sprite] & 0xFE) : ppu.spriteTile[sprite];
+        const u8 *indices = ppu.decodedRow(PPU::getTileRowStart(tile, row, 0x8000), flags.xFlip);
+        int offset = x - (ppu.spriteX[sprite] - 8);
+        for (int i = offset; i < 8; ++i) {
+            int slot = i - offset;
+            SpritePixel pixel{indices[i], u8(flags.palette ? 8 : 4), bool(flags.objToBGPrio)};
+            if (slot >= spriteSize) {
+                spriteFifo[spriteSize++] = pixel;
+            } else if (spriteFifo[slot].index == 0) {
+                spriteFifo[slot] = pixel;
             }
         }
-
     }
+};
 
-    const u8 pixelColor[4][4] = {{0xff, 0xff, 0xff, 0xff},
-                                 {0xbb, 0xbb, 0xbb, 0xff},
-                                 {0x88, 0x88, 0x88, 0xff},
-                                 {0x00, 0x00, 0x00, 0xff}};
+class Timer {
+public:
 
-    [[nodiscard]] const u8 *colorisePixel(u8 reg, u8 pixel) const {
-        // for some regs, 00 is transparent
-        u8 pixelCode = (reg >> (2 * pixel)) & 3;
-        auto x = pixelColor[pixelCode];
-        return x;
-    }
+    // clocks per TIMA increment for each TAC input clock select
+    constexpr static uint64_t TIMA_PERIOD[4] = {1024, 16, 64, 256};
 
-    constexpr static u16 OAM_ADDR_START = 0xFE00;
+    uint64_t clock;
+    uint64_t divReset; // clock DIV was last written at
+    vector<u8> &ram;
+    u8 &div;
+    u8 &tima;
+    u8 &tma;
+    u8 &tac;
+    InterruptController &irq;
 
-    void dmaTransfer() {
-        // make sure code is executin gin hram and copying data only from HRAM.
-        u16 startAddress = (u16) dma << 8;
-        u16 endAddress = startAddress | 0xa0;
-        copy(vram.begin() + startAddress, vram.begin() + endAddress, vram.begin() + OAM_ADDR_START);
-    }
+    Timer(vector<u8> &ram, InterruptController &irq) : ram{ram},
+                             div{ram[0xFF04]}, tima{ram[0xFF05]}, tma{ram[0xFF06]}, tac{ram[0xFF07]},
+                             clock{0}, divReset{0}, irq{irq} {
+        tima = 0x00;
+        tma = 0x00;
+        tac = 0x00;
 
+    }
 
-    u16 getTileData(int tile, int row, u16 addrStart) {
+    // brings DIV and TIMA up to cpuClock
+    void run(uint64_t cpuClock) {
+        if (cpuClock <= clock) {
+            return;
+        }
 
-        int rowStride = 2;
-        u16 rowStart = addrStart + tile * (rowStride * 8) + row * rowStride;
-        u16 colorData = (((u16) vram[rowStart]) << 8) | vram[rowStart + 1];
+        if (tac & 0x4) {
+            uint64_t period = TIMA_PERIOD[tac & 0x3];
+            uint64_t increments = cpuClock / period - clock / period;
+            while (increments > 0) {
+                uint64_t untilOverflow = 0x100 - tima;
+                if (increments < untilOverflow) {
+                    tima += increments;
+                    break;
+                }
+                increments -= untilOverflow;
+                tima = tma;
+                irq.request(InterruptController::TIMER);
+            }
+        }
 
-        return colorData;
+        clock = cpuClock;
+        div = (clock - divReset) >> 8;
     }
 
-    u16 getBackgroundTileMapDataRow(int ix, int row) {
-        assert(lcdControl.bgDisplayEnabled);
-        if (lcdControl.bgWindowTileDataSelect) {
-            u8 tile = lcdControl.bgTileMapDisplaySelect ? vram[0x9C00 + ix] : vram[0x9800 + ix];
-            return getTileData(tile, row, 0x8000);
-        } else {
-            auto tile = static_cast<int8_t>(lcdControl.bgTileMapDisplaySelect ? vram[0x9C00 + ix] : vram[0x9800 + ix]);
-            return getTileData(tile, row, 0x9000);
-        }
+    // any write resets the divider
+    void resetDivider() {
+        divReset = clock;
+        div = 0;
     }
 
-    u16 getWindowTileMapDataRow(int ix, int row) {
-        assert(lcdControl.windowDispEnabled);
-        if (lcdControl.bgWindowTileDataSelect) {
-            u8 tile = lcdControl.windowTileMapDisplaySelect ? vram[0x9C00 + ix] : vram[0x9800 + ix];
-            return getTileData(tile, row, 0x8000);
-        } else {
-            auto tile = static_cast<int8_t>(lcdControl.windowTileMapDisplaySelect ? vram[0x9C00 + ix] : vram[0x9800 +
-                                                                                                             ix]);
-            return getTileData(tile, row, 0x9000);
+    // first clock at which TIMA can overflow and raise the timer interrupt
+    [[nodiscard]] uint64_t nextInterruptClock() const {
+        if (!(tac & 0x4)) {
+            return UINT64_MAX;
         }
+        uint64_t period = TIMA_PERIOD[tac & 0x3];
+        return (clock / period + 0x100 - tima) * period;
     }
 
-    void verticalTiming() {
-
-        // oam search (20 clock), pixel search (43 clock), h-blank (51 clock), v-blank
-
-        // oam search:, visible sprites,
-        // DAM - copy 160clocks
-        // send pixel to lcd every clock cycles:
+};
 
-        // fetch - background tile, data 0, data 1
-        // to scroll, discard pixels
-        //
+// OAM DMA started by writing the source page to 0xFF46. One byte moves per M-cycle over 160 M-cycles, and the
+// bus keeps the cpu in 0xFF00-0xFFFF meanwhile. Nothing steps it: bytes are copied up to the current clock
+// when the cpu hits the lock or the ppu is about to read OAM, and the lock goes once all of them have moved.
+class OAMDMA {
+public:
+    constexpr static uint64_t CLOCKS_PER_BYTE = 4;
+    constexpr static int BYTES = 0xA0;
 
+    Bus &bus;
+    vector<u8> &ram;
+    PPU &ppu;
+    bool active;
+    u16 source;
+    uint64_t startClock;
+    int copied;
+
+    OAMDMA(Bus &bus, vector<u8> &ram, PPU &ppu) : bus{bus}, ram{ram}, ppu{ppu}, active{false}, source{0},
+                                                  startClock{0}, copied{0} {
     }
 
-    void debugInitializeCartridgeHeader() {
-#ifdef VERBOSE
-        dumpCartridgeHeader(vram);
-#endif
-
-#ifdef DEBUG
-        vram[0x100] = 0;
-        vram[0x102] = 0;
-
-        array<u8, 56> nintendoHeaderBmp = {
-                0xCE, 0xED, 0x66, 0x66, 0xCC, 0x0D, 0x00, 0x0B, 0x03, 0x73, 0x00, 0x83, 0x00, 0x0C, 0x00, 0x0D,
-                0x00, 0x08, 0x11, 0x1F, 0x88, 0x89, 0x00, 0x0E, 0xDC, 0xCC, 0x6E, 0xE6, 0xDD, 0xDD, 0xD9, 0x99,
-                0xBB, 0xBB, 0x67, 0x63, 0x6E, 0x0E, 0xEC, 0xCC, 0xDD, 0xDC, 0x99, 0x9F, 0xBB, 0xB9, 0x33, 0x3E,
-                0x3C, 0x42, 0xB9, 0xA5, 0xB9, 0xA5, 0x42, 0x3C
-        };
+    void start(u8 page, uint64_t clock) {
+        run(clock);
+        // 0xE000 and up reads the echo of work ram
+        source = page >= 0xE0 ? (page - 0x20) << 8 : page << 8;
+        startClock = clock;
+        copied = 0;
+        active = true;
+        bus.lock();
+    }
 
-        for (int i = 0; i < nintendoHeaderBmp.size(); ++i) {
-            vram[0x104 + i] = nintendoHeaderBmp[i];
+    void run(uint64_t clock) {
+        if (!active) {
+            return;
         }
-
-        array<u8, 16> title = {'J', 'O', 'S', 'H', 'B', 'O', 'Y', 'A', 'D', 'V', 'E', 'N', 'T', 'U', 'R', 'E'};
-        for (int i = 0; i < title.size(); ++i) {
-            vram[0x134 + i] = title[i];
+        int due = clock < startClock ? 0 : int(min<uint64_t>(BYTES, (clock - startClock) / CLOCKS_PER_BYTE));
+        if (copied < due) {
+            ppu.oamWritten();
         }
+        for (; copied < due; ++copied) {
+            ram[0xFE00 + copied] = bus.readUnlocked(source + copied);
+        }
+        if (copied == BYTES) {
+            active = false;
+            bus.unlock();
+        }
+    }
 
-        vram[0x0147] = 0x0;
-        vram[0x0148] = 0;
-        vram[0x149] = 0;
-
-        assert(vram[0x0146] == 0);
-        std::cout << "Cartridge memory type: " << vram[0x147] << std::endl;
-        assert(vram[0x149] == 0);
-#endif
-
+    [[nodiscard]] uint64_t endClock() const {
+        return startClock + BYTES * CLOCKS_PER_BYTE;
     }
+};
 
+// Recognises busy-wait loops that poll LY, STAT, DIV or TIMA, e.g.
+//     ldh a, (0x44); cp 0x90; jr nz, -6
+// and moves the cpu clock forward over the iterations that are bound to read the same value. The last
+// iteration is always left to the interpreter so registers and flags come out exactly as without skipping.
+class IdleLoopSkipper {
+public:
+    constexpr static int MAX_LOOP_LEN = 4;
+
+    struct IdleLoop {
+        bool idle;
+        u8 polled;       // io register the loop reads
+        u8 cycles;       // clocks per iteration with the branch taken
+        u8 branchOffset; // clocks from the loop start to the start of the branch
+        u32 pageVersion;
+    };
 
-    [[nodiscard]] bool isPixelTransfer() const noexcept {
-        return lcdStatus.modeFlag == 3;
-    }
+    CPU &cpu;
+    Timer &timer;
+    PPU &ppu;
+    unordered_map<u32, IdleLoop> loops;
+    // per address the bank and page version it was found not to start an idle loop at, so most addresses cost
+    // one lookup. Writing to or remapping the page bumps its version and the address is looked at again
+    vector<uint64_t> rejected;
 
-    [[nodiscard]] bool isHblank() const noexcept {
-        return lcdStatus.modeFlag == 0;
-    }
+    uint64_t skips;
+    uint64_t skippedClocks;
 
-    [[nodiscard]] bool isVblank() const noexcept {
-        return lcdStatus.modeFlag == 1;
+    IdleLoopSkipper(CPU &cpu, Timer &timer, PPU &ppu) : cpu{cpu}, timer{timer}, ppu{ppu},
+                                                        rejected(0x10000, UINT64_MAX), skips{0}, skippedClocks{0} {
     }
 
-    bool vramAccessLegal() const {
-        return !isPixelTransfer();
+    // deadline is the last clock an instruction may start at before the next event
+    bool skip(uint64_t deadline) {
+        u16 pc = cpu.pc;
+        u16 bank = pc >= 0x4000 && pc < 0x8000 ? cpu.bus.romBank : 0;
+        uint64_t stamp = (uint64_t(bank) << 32) | cpu.bus.pageVersion[pc >> 8];
+        return !cpu.imePending && rejected[pc] != stamp && skipFrom(pc, bank, stamp, deadline);
     }
 
-    bool oamAccessLegal() const {
-        return isHblank() || isVblank();
-    }
+    bool skipFrom(u16 pc, u16 bank, uint64_t stamp, uint64_t deadline) {
+        // every loop we handle starts with ldh a, (n). Nothing is cached while OAM DMA hides the code
+        if (cpu.read8(pc) != 0xF0 || !isPolledRegister(cpu.read8(pc + 1))) {
+            if (!cpu.bus.locked) {
+                rejected[pc] = stamp;
+            }
+            return false;
+        }
+        u32 key = (u32(bank) << 16) | pc;
+        auto it = loops.find(key);
+        if (it == loops.end() || it->second.pageVersion != cpu.bus.pageVersion[pc >> 8]) {
+            it = loops.insert_or_assign(key, detect(pc)).first;
+        }
+        const IdleLoop &loop = it->second;
+        if (!loop.idle) {
+            rejected[pc] = stamp;
+            return false;
+        }
+        if (!spins(pc)) {
+            return false;
+        }
 
-    void oamInterrupt() {
-        throw "Not implemeneted";
-    }
+        uint64_t changesAt;
+        if (loop.polled == 0x41 || loop.polled == 0x44) {
+            changesAt = ppu.nextRegisterChange(cpu.clock);
+        } else if (loop.polled == 0x04) {
+            changesAt = timer.divReset + ((cpu.clock - timer.divReset) / 256 + 1) * 256;
+        } else if (timer.tac & 0x4) {
+            uint64_t period = Timer::TIMA_PERIOD[timer.tac & 0x3];
+            changesAt = (cpu.clock / period + 1) * period;
+        } else {
+            changesAt = UINT64_MAX;
+        }
 
-    void coincidenceInterruptt() {
-        throw "Not implemented";
-    }
+        // iterations whose instructions all start in time, the first one starting now
+        uint64_t iterations = min(iterationsBefore(deadline + 1, loop.branchOffset, loop.cycles),
+                                  min(iterationsBefore(changesAt, 0, loop.cycles),
+                                      iterationsBefore(timer.nextInterruptClock(), loop.branchOffset,
+                                                       loop.cycles)));
+        if (iterations < 2) {
+            return false;
+        }
 
-    void oamSearch() {
-        clock += 80;
+        uint64_t skipped = (iterations - 1) * loop.cycles;
+        cpu.clock += skipped;
+        ++skips;
+        skippedClocks += skipped;
+        return true;
     }
 
-    void hblankInterrupt() {
-        throw "Not implemented";
+    // number of iterations from now whose instruction at offset starts before limit
+    [[nodiscard]] uint64_t iterationsBefore(uint64_t limit, u8 offset, u8 cycles) const {
+        if (limit == UINT64_MAX) {
+            return UINT64_MAX;
+        }
+        if (limit <= cpu.clock + offset) {
+            return 0;
+        }
+        return (limit - 1 - cpu.clock - offset) / cycles + 1;
     }
 
-    void vBlankInterrupt() {
-        throw "Not implemented";
+    constexpr static bool isPolledRegister(u8 reg) {
+        return reg == 0x41 || reg == 0x44 || reg == 0x04 || reg == 0x05;
     }
 
+    // the loop may only read one polled register and test it with and/cp/bit before branching back
+    IdleLoop detect(u16 pc) const {
+        IdleLoop loop{false, 0, 0, 0, cpu.bus.pageVersion[pc >> 8]};
+        u16 addr = pc;
+        bool polled = false;
+        for (int i = 0; i < MAX_LOOP_LEN; ++i) {
+            u8 opcode = cpu.read8(addr);
+            u8 operand = cpu.read8(addr + 1);
+            if (opcode == 0x20 || opcode == 0x28 || opcode == 0x30 || opcode == 0x38) {
+                u16 target = addr + 2 + static_cast<int8_t>(operand);
+                loop.branchOffset = loop.cycles;
+                loop.cycles += OPCODE_CYCLES_BRANCH[opcode];
+                loop.idle = polled && target == pc && (addr + 1) >> 8 == pc >> 8;
+                return loop;
+            } else if (opcode == 0xF0 && !polled && isPolledRegister(operand)) {
+                loop.polled = operand;
+                polled = true;
+                loop.cycles += OPCODE_CYCLES[opcode];
+            } else if ((opcode == 0xE6 || opcode == 0xFE) && polled) {
+                loop.cycles += OPCODE_CYCLES[opcode];
+            } else if (opcode == 0xCB && (operand & 0xC7) == 0x47 && polled) {
+                loop.cycles += CB_OPCODE_CYCLES[operand];
+            } else {
+                return loop;
+            }
+            addr += OPCODE_LENGTH[opcode];
+        }
+        return loop;
+    }
 
-    void hBlank() {
-        clock += 204;
+    // whether an iteration started now takes the branch back to pc
+    [[nodiscard]] bool spins(u16 pc) const {
+        u8 a = 0;
+        bool z = cpu.zeroFlag();
+        bool carry = cpu.carryFlag();
+        u16 addr = pc;
+        while (true) {
+            u8 opcode = cpu.read8(addr);
+            u8 operand = cpu.read8(addr + 1);
+            switch (opcode) {
+                case 0xF0:
+                    a = cpu.read8(0xFF00 | operand);
+                    break;
+                case 0xE6:
+                    a &= operand;
+                    z = a == 0;
+                    carry = false;
+                    break;
+                case 0xFE:
+                    z = a == operand;
+                    carry = a < operand;
+                    break;
+                case 0xCB:
+                    z = ((a >> ((operand >> 3) & 7)) & 1) == 0;
+                    break;
+                case 0x20:
+                    return !z;
+                case 0x28:
+                    return z;
+                case 0x30:
+                    return !carry;
+                default:
+                    return carry;
+            }
+            addr += OPCODE_LENGTH[opcode];
+        }
     }
 
-    void vblankRow() {
-        clock += 456;
+    void printStats(ostream &out, const string &title, uint64_t totalClocks) const {
+        out << "Idle loops [" << title << "]: " << loops.size() << " candidates, " << skips << " skips, "
+            << skippedClocks << " clocks skipped";
+        if (totalClocks) {
+            out << " (" << 100.0 * skippedClocks / totalClocks << "% of emulated time)";
+        }
+        out << endl;
     }
 };
 
-
-class Timer {
+// Everything outside the cpu that has to happen at a point in emulated time is an event here. The cpu runs
+// uninterrupted up to the earliest one, then the events that are due are handled.
+// Each type has at most one live event: scheduling again replaces it, and replaced entries are dropped when
+// they reach the top of the heap.
+class Scheduler {
 public:
+    enum EventType : u8 {
+        FRAME_START,
+        VBLANK,
+        LCD_STAT,
+        TIMER_OVERFLOW,
+        APU_TICK,
+        OAM_DMA_END,
+        SERIAL_TRANSFER,
+        EVENT_TYPES
+    };
 
-    u8 clock;
-    vector<u8> &ram;
-    u8 &div;
-    u8 &tima;
-    u8 &tma;
-    u8 &tac;
-    InterruptFlag &ifReg;
+    struct Event {
+        uint64_t clock;
+        EventType type;
 
-    Timer(vector<u8> &ram) : ram{ram},
-                             div{ram[0xFF04]}, tima{ram[0xFF05]}, tma{ram[0xFF06]}, tac{ram[0xFF07]},
-                             clock{0},
-                             ifReg{*reinterpret_cast<InterruptFlag *>(ram[0xFF0F])} {
-        tima = 0x00;
-        tma = 0x00;
-        tac = 0x00;
+        bool operator>(const Event &e) const {
+            return clock > e.clock || (clock == e.clock && type > e.type);
+        }
+    };
 
-    }
+    priority_queue<Event, vector<Event>, greater<>> events;
+    array<uint64_t, EVENT_TYPES> scheduledAt;
 
-    void run() {
+    Scheduler() {
+        scheduledAt.fill(UINT64_MAX);
+    }
 
-        if (div != (clock >> 8)) {
-            div = 0;
-        } else {
-            div = (clock + 4) >> 8;
+    void schedule(EventType type, uint64_t clock) {
+        if (scheduledAt[type] == clock) {
+            return;
         }
+        scheduledAt[type] = clock;
+        events.push({clock, type});
+    }
 
-        clock += 4;
-        int updateFreq = 1 << (12 + 2 * (3 - ((tac & 0x3) - 1) % 4));
-        bool isInc = (clock & (updateFreq - 1)) == 0;
+    void cancel(EventType type) {
+        scheduledAt[type] = UINT64_MAX;
+    }
 
-        if (tima == 0xFF && isInc) {
-            tima = tma;
-            ifReg.timer = true;
-        }
+    // clock of the earliest live event
+    uint64_t nextClock() {
+        dropReplaced();
+        return events.empty() ? UINT64_MAX : events.top().clock;
+    }
 
+    // takes the earliest live event if it is before limit
+    bool popBefore(uint64_t limit, Event &e) {
+        dropReplaced();
+        if (events.empty() || events.top().clock >= limit) {
+            return false;
+        }
+        e = events.top();
+        events.pop();
+        scheduledAt[e.type] = UINT64_MAX;
+        return true;
     }
 
+private:
+    void dropReplaced() {
+        while (!events.empty() && events.top().clock != scheduledAt[events.top().type]) {
+            events.pop();
+        }
+    }
 };
 
+// Renderer draws the lines the ppu hands over: ScanlineRenderer, or PixelFifoRenderer for ROMs that need
+// dot accuracy. Being a template parameter the fast build carries nothing of the other.
+template<typename Renderer = ScanlineRenderer>
 class gb_emu {
 public:
 
     vector<u8> ram;
+    Bus bus;
+    Cartridge cartridge;
+    shared_ptr<const MappedFile> bootROM;
+    bool bootROMMapped;
+    InterruptController irq;
     PPU ppu;
+    Renderer renderer;
     CPU cpu;
+    BlockTranslator translator;
     AudioDriver ad;
     Timer timer;
+    OAMDMA oamDMA;
     Joypad jp;
-    InterruptFlag &ifReg;
+    IdleLoopSkipper idleLoops;
+
+    Scheduler scheduler;
+
+    constexpr static uint64_t CLOCKS_PER_SECOND = 1 << 22;
+    constexpr static double FRAMES_PER_SECOND = double(CLOCKS_PER_SECOND) / PPU::CLOCKS_PER_FRAME; // ~59.73
+    constexpr static uint64_t CLOCKS_PER_APU_TICK = 8192; // 512Hz frame sequencer
+    constexpr static uint64_t CLOCKS_PER_SERIAL_TRANSFER = 4096; // 8 bits at 8192Hz
+
+    bool skipIdleLoops;
+    bool translateBlocks; // off runs everything through the interpreter
+    bool frameDone;
 
     gb_emu(const string &bootROM, const string &cartridgeROM, vector<u8> &pixels) :
-            ram(0x10000, 0), ppu{bootROM, cartridgeROM, pixels, ram}, cpu{ram},
-            ad{ram}, timer{ram}, ifReg{*reinterpret_cast<InterruptFlag *>(&ram[0xFF0F])},
-            jp{ram} {
+            gb_emu{bootROM, cartridgeROM, Cartridge::savePath(cartridgeROM), pixels} {}
+
+    // an empty saveFile runs without persisting the cartridge ram
+    gb_emu(const string &bootROM, const string &cartridgeROM, const string &saveFile, vector<u8> &pixels) :
+            ram(0x10000, 0), bus{ram}, cartridge{bus, cartridgeROM, saveFile},
+            bootROM{MappedFile::openShared(bootROM, 0x100)}, bootROMMapped{true},
+            irq{ram}, ppu{pixels, ram}, renderer{ppu}, cpu{bus, irq}, translator{cpu}, ad{ram},
+            timer{ram, irq}, oamDMA{bus, ram, ppu}, jp{ram, irq},
+            idleLoops{cpu, timer, ppu}, skipIdleLoops{true}, translateBlocks{true}, frameDone{false} {
+        bus.mapReadOnly(0x00, this->bootROM->data);
+        mapIORegisters();
+        mapTileData();
+        startFrame(0);
+        scheduler.schedule(Scheduler::APU_TICK, CLOCKS_PER_APU_TICK);
+    }
+
+    void mapIORegisters() {
+        bus.onIORead(0xFF04, [this](u16 addr) {
+            timer.run(cpu.clock);
+            return ram[addr];
+        });
+        bus.onIORead(0xFF05, [this](u16 addr) {
+            timer.run(cpu.clock);
+            return ram[addr];
+        });
+        bus.onIOWrite(0xFF02, [this](u16 addr, u8 val) {
+            ram[addr] = val;
+            // nothing is ever connected, a transfer on the internal clock shifts in 0xFF
+            if ((val & 0x81) == 0x81) {
+                scheduler.schedule(Scheduler::SERIAL_TRANSFER, cpu.clock + CLOCKS_PER_SERIAL_TRANSFER);
+            }
+        });
+        bus.onIOWrite(0xFF04, [this](u16, u8) {
+            timer.run(cpu.clock);
+            timer.resetDivider();
+        });
+        for (u16 addr = 0xFF05; addr <= 0xFF07; ++addr) {
+            bus.onIOWrite(addr, [this](u16 addr, u8 val) {
+                timer.run(cpu.clock);
+                ram[addr] = val;
+                scheduleTimer();
+            });
+        }
+        for (u16 addr: {0xFF0F, 0xFFFF}) {
+            bus.onIOWrite(addr, [this](u16 addr, u8 val) {
+                ram[addr] = val;
+                irq.update();
+            });
+        }
+        for (u16 addr = 0xFF10; addr < 0xFF40; ++addr) {
+            bus.onIOWrite(addr, [this](u16 addr, u8 val) {
+                ad.writeRegister(addr, val, cpu.clock);
+            });
+        }
+        for (u16 addr: {0xFF41, 0xFF44}) {
+            bus.onIORead(addr, [this](u16 addr) {
+                ppu.syncRegisters(cpu.clock);
+                return ram[addr];
+            });
+        }
+        for (u16 addr = 0xFF40; addr <= 0xFF4B; ++addr) {
+            bus.onIOWrite(addr, [this](u16 addr, u8 val) {
+                catchUpPPU(cpu.clock);
+                ppu.logRegisterWrite(cpu.clock, addr, val);
+                bool wasEnabled = ppu.lcdControl.lcdEnabled;
+                bool statWasHigh = ppu.statLineAt(cpu.clock);
+                ram[addr] = val;
+                if (addr >= 0xFF47 && addr <= 0xFF49) {
+                    ppu.palettesWritten();
+                }
+                if (!wasEnabled && ppu.lcdControl.lcdEnabled) {
+                    // switching the lcd on starts a frame from line 0
+                    startFrame(cpu.clock);
+                }
+                // e.g. enabling a source that is already true, or LYC set to the current line, raises it now.
+                // scheduleStat only finds the rising edges still to come
+                if (!statWasHigh && ppu.statLineAt(cpu.clock)) {
+                    irq.request(InterruptController::LCD_STAT);
+                }
+                scheduleStat();
+            });
+        }
+        bus.setWriteHandler(0xFE, [this](u16 addr, u8 val) {
+            if (addr < 0xFEA0) {
+                catchUpPPU(cpu.clock);
+                ram[addr] = val;
+                ppu.oamWritten();
+            }
+        });
+        bus.onIOWrite(0xFF46, [this](u16, u8 val) {
+            catchUpPPU(cpu.clock);
+            ppu.dma = val;
+            oamDMA.start(val, cpu.clock);
+            scheduler.schedule(Scheduler::OAM_DMA_END, oamDMA.endClock());
+        });
+        bus.releaseLock = [this]() {
+            oamDMA.run(cpu.clock);
+            return !oamDMA.active;
+        };
+        bus.onIOWrite(0xFF50, [this](u16 addr, u8 val) {
+            ram[addr] = val;
+            if (bootROMMapped && (val & 0x1)) {
+                bootROMMapped = false;
+                cartridge.mapLowBank();
+            }
+        });
+        translator.idleLoopAt = [this](u16 pc) {
+            return skipIdleLoops && idleLoops.detect(pc).idle;
+        };
+#ifdef DIFFERENTIAL_TEST
+        translator.saveDevices = [this]() {
+            return saveDevices();
+        };
+#endif
+    }
+
+#ifdef DIFFERENTIAL_TEST
+    // what the io handlers a block runs can move on besides ram: the memory map and its DMA lock, the bank
+    // registers, the DMA's progress and the apu a trigger runs. The interpreter replays the block from here
+    function<void()> saveDevices() {
+        auto readPages = bus.readPages;
+        auto writePages = bus.writePages;
+        auto unlockedReadPages = bus.unlockedReadPages;
+        auto unlockedWritePages = bus.unlockedWritePages;
+        bool locked = bus.locked;
+        u16 busBank = bus.romBank;
+        bool ramEnabled = cartridge.ramEnabled;
+        u16 romBank = cartridge.romBank;
+        u8 ramBank = cartridge.ramBank;
+        u8 bankHi = cartridge.bankHi;
+        bool advancedBanking = cartridge.advancedBanking;
+        u8 lastLatchWrite = cartridge.lastLatchWrite;
+        auto rtcLatched = cartridge.rtcLatched;
+        bool dmaActive = oamDMA.active;
+        u16 dmaSource = oamDMA.source;
+        uint64_t dmaStart = oamDMA.startClock;
+        int dmaCopied = oamDMA.copied;
+        bool boot = bootROMMapped;
+        uint64_t apuClock = ad.clock;
+        array<bool, 4> channelsWritten{ad.pulseAWritten, ad.pulseBWritten, ad.waveWritten, ad.noiseWritten};
+        return [=]() {
+            bus.readPages = readPages;
+            bus.writePages = writePages;
+            bus.unlockedReadPages = unlockedReadPages;
+            bus.unlockedWritePages = unlockedWritePages;
+            bus.locked = locked;
+            bus.romBank = busBank;
+            cartridge.ramEnabled = ramEnabled;
+            cartridge.romBank = romBank;
+            cartridge.ramBank = ramBank;
+            cartridge.bankHi = bankHi;
+            cartridge.advancedBanking = advancedBanking;
+            cartridge.lastLatchWrite = lastLatchWrite;
+            cartridge.rtcLatched = rtcLatched;
+            oamDMA.active = dmaActive;
+            oamDMA.source = dmaSource;
+            oamDMA.startClock = dmaStart;
+            oamDMA.copied = dmaCopied;
+            bootROMMapped = boot;
+            ad.clock = apuClock;
+            ad.pulseAWritten = channelsWritten[0];
+            ad.pulseBWritten = channelsWritten[1];
+            ad.waveWritten = channelsWritten[2];
+            ad.noiseWritten = channelsWritten[3];
+        };
+    }
+#endif
 
+    ~gb_emu() {
+#ifdef VERBOSE
+        idleLoops.printStats(cout, cartridge.title(), cpu.clock);
+#endif
     }
 
-    void run(vector<sf::Event> &es) {
+    // runs up to the next VBlank, without draw the frame is emulated but its pixels are left as they were
+    void run(vector<sf::Event> &es, bool draw = true) {
 
-        // need to set the status registers:
 #ifdef VERBOSE
         auto p1 = chrono::high_resolution_clock::now();
-        uint64_t startingClock[3] = {ppu.clock, cpu.clock, ad.clock};
 #endif
-        for (int i = 0; i < PPU::PIXEL_ROWS; ++i) {
-            uint64_t startClock = ppu.clock;
-            ppu.ly = i;
-            ppu.lcdStatus.coincidenceFlag = ppu.ly == ppu.lyc;
+        if (!es.empty()) {
+            jp.processKeyEvents(es);
+            es.clear();
+        }
 
-            if (ppu.lcdStatus.coincidenceFlag && ppu.lcdStatus.coincidenceInterrupt) {
-                ifReg.lcdStat = true;
-                runDevices(es);
+        ppu.drawing = draw;
+        frameDone = false;
+        while (true) {
+            dispatchEvents(cpu.clock);
+            if (frameDone) {
+                break;
             }
+            runCPU(scheduler.nextClock());
+        }
+
+#ifdef VERBOSE
+        auto p2 = chrono::high_resolution_clock::now();
+        auto pd = p2 - p1;
+        cout << "Screen Render Time taken: " << pd.count() / 1000000.0 << endl;
+#endif
 
-            // all following clockx %x %x cycles in 4MHz
-            // should take 1/60th of a second at 1Mhz
-            // must update lcdc status, and trigger interrupts
+    }
 
-            ppu.lcdStatus.modeFlag = 2;
-            if (ppu.lcdStatus.oamInterrupt) {
-                ppu.oamInterrupt();
+    // deadline is the last clock an instruction may start at before the next event
+    // idle loops are only looked for at or before the last instruction run, i.e. where a branch went back to
+    void runCPU(uint64_t deadline) {
+        u16 lastPC = cpu.pc;
+        while (cpu.clock <= deadline) {
+            if (irq.pending) {
+                cpu.processInterrupts();
             }
+            if (cpu.halted) {
+                skipHalt(deadline);
+            } else if (!skipIdleLoops || cpu.pc > lastPC ||
+                       !idleLoops.skip(deadline)) {
+                if (translateBlocks) {
+                    translator.step(deadline);
+                    lastPC = translator.lastPC;
+                } else {
+                    lastPC = cpu.pc;
+                    cpu.fetchDecodeExecute();
+                }
+            }
+        }
+    }
 
-            ppu.oamSearch();
-            runDevices(es);
-
-            ppu.lcdStatus.modeFlag = 3;
-            ppu.pixelTransfer(i);
-            runDevices(es);
-            ppu.lcdStatus.modeFlag = 0;
-            if (ppu.lcdStatus.hblankInterrupt) {
-                ppu.hblankInterrupt();
+    void dispatchEvents(uint64_t limit) {
+        Scheduler::Event e{};
+        while (scheduler.popBefore(limit, e)) {
+            switch (e.type) {
+                case Scheduler::FRAME_START:
+                    startFrame(e.clock);
+                    break;
+                case Scheduler::VBLANK:
+                    catchUpPPU(e.clock);
+                    watchVideoMemory(false);
+                    if (ppu.lcdControl.lcdEnabled) {
+                        irq.request(InterruptController::VBLANK);
+                    }
+                    frameDone = true;
+                    break;
+                case Scheduler::LCD_STAT:
+                    irq.request(InterruptController::LCD_STAT);
+                    scheduleStat(e.clock);
+                    break;
+                case Scheduler::TIMER_OVERFLOW:
+                    timer.run(e.clock);
+                    scheduleTimer();
+                    break;
+                case Scheduler::APU_TICK:
+                    ad.run(e.clock);
+                    scheduler.schedule(Scheduler::APU_TICK, e.clock + CLOCKS_PER_APU_TICK);
+                    break;
+                case Scheduler::OAM_DMA_END:
+                    oamDMA.run(e.clock);
+                    break;
+                case Scheduler::SERIAL_TRANSFER:
+                    ram[0xFF01] = 0xFF;
+                    ram[0xFF02] &= 0x7F;
+                    irq.request(InterruptController::SERIAL);
+                    break;
+                default:
+                    break;
             }
-            ppu.hBlank();
-            runDevices(es);
+        }
+    }
 
-            usleep(1e6 * (ppu.clock - startClock) / 4 / (1 << 20) / 2);
+    void scheduleTimer() {
+        uint64_t overflow = timer.nextInterruptClock();
+        if (overflow == UINT64_MAX) {
+            scheduler.cancel(Scheduler::TIMER_OVERFLOW);
+        } else {
+            scheduler.schedule(Scheduler::TIMER_OVERFLOW, overflow);
         }
-        ppu.lcdStatus.modeFlag = 1;
-        if (ppu.lcdStatus.vblankInterrupt) {
-            ifReg.vBlank = true;
-            runDevices(es);
+    }
+
+    // the frame keeps its timing with the lcd off so run() still returns once a frame
+    void startFrame(uint64_t clock) {
+        ppu.startFrame(clock);
+        watchVideoMemory(true);
+        scheduler.schedule(Scheduler::VBLANK, ppu.lineStart(PPU::PIXEL_ROWS));
+        scheduler.schedule(Scheduler::FRAME_START, ppu.lineStart(PPU::LINES_PER_FRAME));
+        scheduleStat(clock);
+    }
+
+    void catchUpPPU(uint64_t clock) {
+        ppu.catchUp(clock, [this](uint64_t lineClock) {
+            oamDMA.run(lineClock);
+        }, [this](int line) {
+            renderer.drawLine(line);
+        });
+    }
+
+    // tile data writes always go through a handler so the ppu can mark the decoded row stale
+    void mapTileData() {
+        for (int page = PPU::TILE_DATA_START >> 8; page < PPU::TILE_DATA_END >> 8; ++page) {
+            bus.setWriteHandler(page, [this](u16 addr, u8 val) {
+                catchUpPPU(cpu.clock);
+                ram[addr] = val;
+                ppu.tileDataWritten(addr);
+            });
         }
+    }
 
-        for (int i = 0; i < 10; ++i) {
-            ppu.vblankRow();
-            ppu.ly = ppu.PIXEL_ROWS + i;
-            runDevices(es);
+    // while lines of the frame are still to be drawn tile map writes go through a handler that draws them
+    // first, from VBlank to the end of the frame the pages are written directly, or with the layer cache through
+    // one that only marks the tile
+    void watchVideoMemory(bool watch) {
+        for (int page = PPU::TILE_DATA_END >> 8; page < 0xA0; ++page) {
+            if (watch) {
+                bus.setWriteHandler(page, [this](u16 addr, u8 val) {
+                    catchUpPPU(cpu.clock);
+                    ram[addr] = val;
+#ifdef LAYER_CACHE
+                    ppu.tileMapWritten(addr);
+#endif
+                });
+            } else {
+#ifdef LAYER_CACHE
+                // nothing is left to draw, but the layer cache still has to see the write
+                bus.setWriteHandler(page, [this](u16 addr, u8 val) {
+                    ram[addr] = val;
+                    ppu.tileMapWritten(addr);
+                });
+#else
+                bus.mapMemory(page, &ram[page << 8]);
+#endif
+            }
         }
+    }
 
-        if (cpu.clock > (1 << 22) && ppu.clock > (1 << 22) && ad.clock > (1 << 22)) {
-            cpu.clock = cpu.clock & ((1 << 22) - 1);
-            ppu.clock = ppu.clock & ((1 << 22) - 1);
-            ad.clock = (ad.clock) & ((1 << 22) - 1);
+    void scheduleStat(uint64_t after) {
+        uint64_t next = ppu.nextStatInterrupt(after);
+        if (next == UINT64_MAX) {
+            scheduler.cancel(Scheduler::LCD_STAT);
+        } else {
+            scheduler.schedule(Scheduler::LCD_STAT, next);
         }
+    }
 
-#ifdef VERBOSE
-        auto p2 = chrono::high_resolution_clock::now();
-        auto pd = p2 - p1;
-        cout << "Screen Render Time taken: " << pd.count() / 1000000.0 << endl;
-#endif
+    void scheduleStat() {
+        scheduleStat(cpu.clock);
+    }
 
+    // the cpu only leaves HALT for an interrupt, and every source of one is a scheduled event or the joypad,
+    // which is handled between frames. So move straight past the next event. STOP is only woken by the joypad,
+    // the events on the way just don't wake it.
+    void skipHalt(uint64_t deadline) {
+        uint64_t steps = (max(deadline + 1, cpu.clock + 1) - cpu.clock + 3) / 4;
+        cpu.clock += 4 * steps;
     }
+};
 
-    void runDevices(vector<sf::Event> &es) {
-        while (cpu.clock <= ppu.clock || ad.clock <= ppu.clock) {
-            if (timer.clock <= ppu.clock) {
-                timer.run();
-            }
-            if (cpu.clock <= ppu.clock) {
-                cpu.processInterrupts();
-                cpu.fetchDecodeExecute();
+// hash of a finished frame, only used to compare them
+uint64_t frameHash(const vector<sf::Uint8> &pixels) {
+    uint64_t hash = 0xcbf29ce484222325;
+    for (sf::Uint8 byte: pixels) {
+        hash = (hash ^ byte) * 0x100000001b3;
+    }
+    return hash;
+}
+
+// runs the scanline renderer through the interpreter and through the block translator, and the pixel fifo, side
+// by side without a window and stops at the first frame they don't agree on. Start is held for a few frames now
+// and then so Tetris gets from the title screen into a game with sprites, it starts its OAM DMA routine in HRAM
+// on the way. The cpus have to agree too, a rom that leaves the lcd off is only checked by those. Built with
+// DIFFERENTIAL_TEST every translated block is replayed as well
+int checkFrames(const char *bootROM, const char *rom, int frames) {
+    static constexpr int START_PRESSES[] = {700, 800, 900, 1100, 1500, 1520, 1600};
+    constexpr int PRESS_FRAMES = 5;
+    int frame = 0;
+    auto pressStart = [&frame](auto &emu) {
+        emu.bus.onIORead(0xFF00, [&emu, &frame](u16) {
+            u8 buttons = 0xCF | (emu.ram[0xFF00] & 0x30);
+            for (int at: START_PRESSES) {
+                if (frame >= at && frame < at + PRESS_FRAMES && !(emu.ram[0xFF00] & 0x20)) {
+                    buttons &= ~0x08;
+                }
             }
-            if (ad.clock <= ppu.clock) {
-                ad.run(cpu.clock);
+            return buttons;
+        });
+    };
+
+    vector<sf::Uint8> interpreted(PPU::PIXEL_COLUMNS * PPU::PIXEL_ROWS * 4, 0);
+    vector<sf::Uint8> translated(interpreted.size(), 0);
+    vector<sf::Uint8> fifo(interpreted.size(), 0);
+    // none of them touch the .sav, they all start from blank ram and can't see each other's writes
+    gb_emu<ScanlineRenderer> reference{bootROM, rom, "", interpreted};
+    gb_emu<ScanlineRenderer> translating{bootROM, rom, "", translated};
+    gb_emu<PixelFifoRenderer> fifoEmu{bootROM, rom, "", fifo};
+    reference.translateBlocks = false;
+    pressStart(reference);
+    pressStart(translating);
+    pressStart(fifoEmu);
+
+    vector<sf::Event> events;
+    uint64_t all = 0;
+    for (; frame < frames; ++frame) {
+        reference.run(events, true);
+        translating.run(events, true);
+        fifoEmu.run(events, true);
+        uint64_t hash = frameHash(interpreted);
+        if (frameHash(translated) != hash || frameHash(fifo) != hash) {
+            printf("Frame %d differs: interpreter %016llx, translator %016llx, pixel fifo %016llx\n", frame,
+                   (unsigned long long) hash, (unsigned long long) frameHash(translated),
+                   (unsigned long long) frameHash(fifo));
+            return 1;
+        }
+        for (const CPU *cpu: {&translating.cpu, &fifoEmu.cpu}) {
+            if (cpu->pc != reference.cpu.pc || cpu->sp != reference.cpu.sp || cpu->clock != reference.cpu.clock) {
+                printf("Frame %d: the cpus differ, interpreter pc %04x sp %04x, translator pc %04x sp %04x, "
+                       "pixel fifo pc %04x sp %04x\n", frame, reference.cpu.pc, reference.cpu.sp,
+                       translating.cpu.pc, translating.cpu.sp, fifoEmu.cpu.pc, fifoEmu.cpu.sp);
+                return 1;
             }
-            if (ppu.dma != 0) {
-                ppu.dmaTransfer(); // should take 160 microseconds of 600 cycles
-                ppu.dma = 0;
+        }
+        all = (all ^ hash) * 0x100000001b3;
+    }
+    printf("%d frames match, %016llx\n", frames, (unsigned long long) all);
+    return 0;
+}
+
+// draws frames of random tile data, tile maps, OAM and lcd registers with the scanline renderer and with the pixel
+// fifo for each of the setups and stops at the first frame they don't agree on. Tetris never turns on the window or
+// 8x16 sprites and hardly flips anything, this does all of them. Between lines some of it is rewritten the way the
+// io handlers would, so the layer cache has to find the tiles each write stales. The seed is fixed so a failure
+// can be rerun
+int checkRenderers(int setups) {
+    constexpr uint32_t SEED = 0x3a1f9c07;
+    constexpr int FRAMES_PER_SETUP = 8;
+    srand(SEED);
+    auto noDMA = [](uint64_t) {};
+    for (int setup = 0; setup < setups; ++setup) {
+        vector<u8> ram(0x10000, 0);
+        for (int addr = 0x8000; addr < 0xA000; ++addr) {
+            ram[addr] = rand();
+        }
+        // two sprites in three get a position on the screen, the rest anywhere
+        for (int addr = 0xFE00; addr < 0xFEA0; ++addr) {
+            ram[addr] = rand() % 3 ? rand() % 176 : rand();
+        }
+        ram[0xFF40] = 0x80 | (rand() & 0x7F);
+        for (u16 addr: {0xFF42, 0xFF43, 0xFF47, 0xFF48, 0xFF49}) {
+            ram[addr] = rand();
+        }
+        ram[0xFF4A] = rand() % 150;
+        ram[0xFF4B] = rand() % 170;
+        vector<u8> fifoRAM = ram;
+
+        vector<sf::Uint8> scanlinePixels(PPU::PIXEL_COLUMNS * PPU::PIXEL_ROWS * 4, 0);
+        vector<sf::Uint8> fifoPixels(scanlinePixels.size(), 0);
+        PPU scanlinePPU{scanlinePixels, ram};
+        PPU fifoPPU{fifoPixels, fifoRAM};
+        ScanlineRenderer scanline{scanlinePPU};
+        PixelFifoRenderer fifo{fifoPPU};
+        auto write = [&](u16 addr, u8 val) {
+            ram[addr] = fifoRAM[addr] = val;
+            for (PPU *ppu: {&scanlinePPU, &fifoPPU}) {
+                if (addr < PPU::TILE_DATA_END) {
+                    ppu->tileDataWritten(addr);
+                } else if (addr < 0xA000) {
+#ifdef LAYER_CACHE
+                    ppu->tileMapWritten(addr);
+#endif
+                } else if (addr < 0xFF00) {
+                    ppu->oamWritten();
+                } else if (addr >= 0xFF47 && addr <= 0xFF49) {
+                    ppu->palettesWritten();
+                }
             }
-            if (!es.empty()) {
-                jp.processKeyEvents(es);
+        };
+
+        uint64_t clock = 0;
+        for (int frame = 0; frame < FRAMES_PER_SETUP; ++frame) {
+            scanlinePPU.startFrame(clock);
+            fifoPPU.startFrame(clock);
+            for (int line = 0; line < PPU::PIXEL_ROWS; ++line) {
+                // one line in four is preceded by a burst of writes, mostly to video memory
+                int writes = rand() % 4 ? 0 : rand() % 40;
+                for (int i = 0; i < writes; ++i) {
+                    static constexpr u16 REGISTERS[] = {0xFF40, 0xFF42, 0xFF43, 0xFF47, 0xFF48, 0xFF49, 0xFF4A,
+                                                        0xFF4B};
+                    int kind = rand() % 6;
+                    u8 val = rand();
+                    if (kind < 2) {
+                        write(PPU::TILE_DATA_START + rand() % (PPU::TILE_DATA_END - PPU::TILE_DATA_START), val);
+                    } else if (kind < 4) {
+                        write(PPU::TILE_DATA_END + rand() % (0xA000 - PPU::TILE_DATA_END), val);
+                    } else if (kind < 5) {
+                        write(0xFE00 + rand() % 0xA0, val);
+                    } else {
+                        u16 addr = REGISTERS[rand() % size(REGISTERS)];
+                        write(addr, addr == 0xFF40 ? val | 0x80 : val);
+                    }
+                }
+                scanlinePPU.catchUp(scanlinePPU.lineStart(line + 1), noDMA, [&](int y) {
+                    scanline.drawLine(y);
+                });
+                fifoPPU.catchUp(fifoPPU.lineStart(line + 1), noDMA, [&](int y) {
+                    fifo.drawLine(y);
+                });
+            }
+            clock = scanlinePPU.lineStart(PPU::LINES_PER_FRAME);
+
+            if (scanlinePixels != fifoPixels) {
+                auto differs = mismatch(scanlinePixels.begin(), scanlinePixels.end(), fifoPixels.begin());
+                int line = (differs.first - scanlinePixels.begin()) / (PPU::PIXEL_COLUMNS * 4);
+                printf("Setup %d frame %d differs from line %d: lcdc %02x scx %d scy %d wx %d wy %d\n", setup, frame,
+                       line, ram[0xFF40], ram[0xFF43], ram[0xFF42], ram[0xFF4B], ram[0xFF4A]);
+                return 1;
             }
         }
     }
-};
+    printf("%d setups, %d frames match\n", setups, setups * FRAMES_PER_SETUP);
+    return 0;
+}
 
-int main() {
+// --unthrottled runs as fast as the host allows, --speed N at N times real time, --frameskip N|auto leaves
+// frames undrawn, --palette green uses the DMG's green shades, --scale N sizes the window at N times the
+// screen and --filter sprite|nearest|scale2x|scale3x|scanlines picks how it's scaled up. --check N runs N frames
+// headless through checkFrames instead, --check-renderers N compares the renderers on N random setups. --rom and
+// --boot-rom load other images than the default ones, --save FILE keeps the cartridge ram somewhere other than next
+// to the rom and --no-save doesn't keep it at all
+int main(int argc, char **argv) {
 
     printf("Starting\n");
 
@@ -1656,13 +3427,50 @@ int main() {
 
     srand(RANDOM_GEN_SEED);
 
-    sf::RenderWindow w{sf::VideoMode(PPU::DEVICE_WIDTH, PPU::DEVICE_HEIGHT), "Test", sf::Style::Default};
+    const char *bootROM = "/home/jc/projects/cpp/emulators-cpp/DMG_ROM.bin";
+    const char *rom = "/home/jc/projects/cpp/emulators-cpp/gameboy/tetris.gb";
+    const char *save = nullptr;
+    for (int i = 1; i + 1 < argc; ++i) {
+        if (strcmp(argv[i], "--rom") == 0) {
+            rom = argv[i + 1];
+        } else if (strcmp(argv[i], "--boot-rom") == 0) {
+            bootROM = argv[i + 1];
+        } else if (strcmp(argv[i], "--save") == 0) {
+            save = argv[i + 1];
+        }
+    }
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--no-save") == 0) {
+            save = "";
+        }
+    }
+    string saveFile = save ? save : Cartridge::savePath(rom);
+    for (int i = 1; i + 1 < argc; ++i) {
+        if (strcmp(argv[i], "--check") == 0) {
+            return checkFrames(bootROM, rom, atoi(argv[i + 1]));
+        } else if (strcmp(argv[i], "--check-renderers") == 0) {
+            return checkRenderers(atoi(argv[i + 1]));
+        }
+    }
+
+    int scale = 3;
+    Scaler::Filter filter = Scaler::SPRITE;
+    for (int i = 1; i + 1 < argc; ++i) {
+        if (strcmp(argv[i], "--scale") == 0) {
+            scale = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "--filter") == 0) {
+            filter = Scaler::parseFilter(argv[i + 1]);
+        }
+    }
+    Scaler scaler{PPU::PIXEL_COLUMNS, PPU::PIXEL_ROWS, filter, scale};
+
+    sf::RenderWindow w{sf::VideoMode(scaler.outputWidth(), scaler.outputHeight()), "Test", sf::Style::Default};
 
-    vector<sf::Uint8> pixels(PPU::DEVICE_WIDTH * PPU::DEVICE_HEIGHT * 4, 0);
+    vector<sf::Uint8> pixels(PPU::PIXEL_COLUMNS * PPU::PIXEL_ROWS * 4, 0);
 
 
     sf::Texture texture;
-    if (!texture.create(PPU::DEVICE_WIDTH, PPU::DEVICE_HEIGHT)) {
+    if (!texture.create(scaler.textureWidth(), scaler.textureHeight())) {
         cerr << "Could not create texture, quitting." << endl;
         exit(1);
     }
@@ -1673,33 +3481,57 @@ int main() {
 
     sf::Sprite sprite;
     sprite.setTexture(texture);
+    sprite.setScale(scaler.spriteScale(), scaler.spriteScale());
 
-    gb_emu emu{"/home/jc/projects/cpp/emulators-cpp/DMG_ROM.bin",
-               "/home/jc/projects/cpp/emulators-cpp/gameboy/tetris.gb", pixels};
-//    gb_emu emu{"/home/jc/projects/cpp/emulators-cpp/gameboy/PokemonReg.gb", pixels};
+#ifdef PIXEL_FIFO
+    using Emulator = gb_emu<PixelFifoRenderer>;
+#else
+    using Emulator = gb_emu<ScanlineRenderer>;
+#endif
+
+    Emulator emu{bootROM, rom, saveFile, pixels};
+//    gb_emu emu{"/home/jc/projects/cpp/emulators-cpp/DMG_ROM.bin",
+//               "/home/jc/projects/cpp/emulators-cpp/gameboy/PokemonReg.gb", pixels};
 
     int instructionCount = 0;
 
+    FramePacer pacer{Emulator::FRAMES_PER_SECOND};
+    pacer.parseArgs(argc, argv);
+    for (int i = 1; i + 1 < argc; ++i) {
+        if (strcmp(argv[i], "--palette") == 0 && strcmp(argv[i + 1], "green") == 0) {
+            emu.ppu.setShades(PPU::GREEN_SHADES);
+        }
+    }
+
     while (w.isOpen()) {
         sf::Event e{};
 
         while (w.pollEvent(e)) {
             if (e.type == sf::Event::EventType::Closed) {
                 w.close();
+            } else if (e.type == sf::Event::EventType::Resized) {
+                emu.ppu.changedLines.markAll();
             }
             events.push_back(e);
         }
 
-        w.clear(sf::Color::Black);
-
         ++instructionCount;
 
-        emu.run(events);
-
-        texture.update(&pixels[0]);
-        w.draw(sprite);
-        w.display();
+        bool draw = pacer.shouldDraw();
+        emu.run(events, draw);
+
+        // only changed lines are scaled and uploaded, a frame identical to the last one isn't shown again
+        if (draw && emu.ppu.changedLines.any()) {
+            emu.ppu.changedLines.flush([&](int from, int to) {
+                Scaler::Region region = scaler.present(&pixels[0], from, to);
+                texture.update(region.pixels, scaler.textureWidth(), region.height, 0, region.y);
+            });
+            w.clear(sf::Color::Black);
+            w.draw(sprite);
+            w.display();
+        }
 
+        pacer.waitForNextFrame();
     }
 
 }
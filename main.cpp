@@ -1,5 +1,6 @@
 #include <iostream>
 #include "chip8.h"
+#include "frame_pacer.h"
 #include <cstdint>
 #include <bitset>
 #include <vector>
@@ -14,7 +15,7 @@
 using namespace std;
 
 
-int main() {
+int main(int argc, char **argv) {
     cout << '\a' << endl;
     constexpr uint32_t RANDOM_GEN_SEED = 0x7645387a;
     constexpr int WIDTH = 640;
@@ -43,9 +44,12 @@ int main() {
     sf::Sprite sprite;
     sprite.setTexture(texture);
 
-    int instructionCount = 0;
-
     constexpr int INSTRUCTIONS_PER_SECOND = 600;
+    constexpr int FRAMES_PER_SECOND = 60;
+
+    // the timers count down at 60Hz, so a frame is the instructions between two timer ticks
+    FramePacer pacer{FRAMES_PER_SECOND};
+    pacer.parseArgs(argc, argv);
 
     while (w.isOpen()) {
 
@@ -53,25 +57,31 @@ int main() {
         while (w.pollEvent(e)) {
             if (e.type == sf::Event::EventType::Closed) {
                 w.close();
+            } else if (e.type == sf::Event::EventType::Resized) {
+                emu.dirtyRows().markAll();
             }
             events.push_back(e);
         }
-        w.clear(sf::Color::Black);
 
         emu.processKeyboardEvents(events);
-        uint16_t instr = emu.fetch();
-        emu.decodeAndExecute(instr);
+        for (int i = 0; i < INSTRUCTIONS_PER_SECOND / FRAMES_PER_SECOND; ++i) {
+            uint16_t instr = emu.fetch();
+            emu.decodeAndExecute(instr);
+        }
 //        emu.draw();
-
-        ++instructionCount;
-        if(instructionCount % (INSTRUCTIONS_PER_SECOND/60) == 0) {
-            usleep(1000000/60);
-            emu.updateTimers();
+        emu.updateTimers();
+
+        // only the rows drawn over since the last upload go to the texture, an unchanged screen isn't shown again
+        if (pacer.shouldDraw() && emu.dirtyRows().any()) {
+            emu.dirtyRows().flush([&](int from, int to) {
+                texture.update(pixels + 4 * from * WIDTH, WIDTH, to - from, 0, from);
+            });
+            w.clear(sf::Color::Black);
+            w.draw(sprite);
+            w.display();
         }
 
-        texture.update(pixels);
-        w.draw(sprite);
-        w.display();
+        pacer.waitForNextFrame();
     }
 
 
@@ -0,0 +1,132 @@
+//
+// Created by jc on 17/10/26.
+//
+
+#ifndef GBA_EMULATOR_MAPPED_FILE_H
+#define GBA_EMULATOR_MAPPED_FILE_H
+
+#include <cstdint>
+#include <cstdlib>
+#include <climits>
+#include <string>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <chrono>
+#include <unordered_map>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// A whole file mapped into memory.
+// Read-only images come from openShared, which hands every caller in the process the same mapping, and the
+// page cache shares it between processes.
+// Writable mappings are MAP_SHARED so stores land in the file, a background thread msyncs them periodically.
+class MappedFile {
+public:
+    constexpr static std::chrono::milliseconds FLUSH_PERIOD{1000};
+
+    uint8_t *data;
+    size_t size;
+    size_t mappedSize;
+    bool writable;
+
+    // maps at least minSize bytes, anything past the end of the file reads as 0
+    static std::shared_ptr<const MappedFile> openShared(const std::string &path, size_t minSize = 0) {
+        static std::mutex cacheMutex;
+        static std::unordered_map<std::string, std::weak_ptr<const MappedFile>> cache;
+
+        char resolved[PATH_MAX];
+        std::string key = realpath(path.c_str(), resolved) ? resolved : path;
+
+        std::lock_guard<std::mutex> lock{cacheMutex};
+        auto cached = cache[key].lock();
+        if (cached && cached->size >= minSize) {
+            return cached;
+        }
+        std::shared_ptr<const MappedFile> file = std::make_shared<MappedFile>(key, minSize, false);
+        cache[key] = file;
+        return file;
+    }
+
+    MappedFile(const std::string &path, size_t minSize, bool writable) : data{nullptr}, size{0}, mappedSize{0},
+                                                                         writable{writable}, stopFlusher{false} {
+        int fd = open(path.c_str(), writable ? O_RDWR | O_CREAT : O_RDONLY, 0644);
+        if (fd < 0) {
+            throw "Could not open file to map";
+        }
+        struct stat st{};
+        fstat(fd, &st);
+        size_t fileSize = st.st_size;
+        if (writable && fileSize < minSize) {
+            // the file grows to fit so every mapped byte is backed, a mapping past the end would SIGBUS on access
+            if (ftruncate(fd, minSize) != 0) {
+                close(fd);
+                throw "Could not resize file to map";
+            }
+            fileSize = minSize;
+        }
+        size = std::max(fileSize, minSize);
+        mappedSize = std::max<size_t>(size, 1);
+
+        int prot = writable ? PROT_READ | PROT_WRITE : PROT_READ;
+        if (fileSize >= size) {
+            void *addr = mmap(nullptr, mappedSize, prot, MAP_SHARED, fd, 0);
+            data = addr == MAP_FAILED ? nullptr : static_cast<uint8_t *>(addr);
+        } else {
+            // reserve zeroed memory for the whole size then put the file over the start of it, touching the pages
+            // past the end of the file directly would fault
+            void *addr = mmap(nullptr, mappedSize, prot, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (addr != MAP_FAILED && fileSize > 0 &&
+                mmap(addr, fileSize, prot, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+                munmap(addr, mappedSize);
+                addr = MAP_FAILED;
+            }
+            data = addr == MAP_FAILED ? nullptr : static_cast<uint8_t *>(addr);
+        }
+        close(fd);
+        if (!data) {
+            throw "Could not map file";
+        }
+
+        if (writable) {
+            flusher = std::thread([this]() {
+                std::unique_lock<std::mutex> lock{flusherMutex};
+                while (!flusherWake.wait_for(lock, FLUSH_PERIOD, [this]() { return stopFlusher; })) {
+                    flush(MS_ASYNC);
+                }
+            });
+        }
+    }
+
+    MappedFile(const MappedFile &) = delete;
+
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    ~MappedFile() {
+        if (flusher.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock{flusherMutex};
+                stopFlusher = true;
+            }
+            flusherWake.notify_one();
+            flusher.join();
+            flush(MS_SYNC);
+        }
+        munmap(data, mappedSize);
+    }
+
+    void flush(int flags) const {
+        msync(data, mappedSize, flags);
+    }
+
+private:
+    std::thread flusher;
+    std::mutex flusherMutex;
+    std::condition_variable flusherWake;
+    bool stopFlusher;
+};
+
+#endif //GBA_EMULATOR_MAPPED_FILE_H